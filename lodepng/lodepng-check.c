@@ -0,0 +1,957 @@
+/*
+Checks and benchmarks for the optimized code paths of lodepng, which compare them against the
+portable code they replace. lodepng.c is included to reach its static functions. Built and run
+with 'make check', 'make bench' runs the benchmarks instead.
+*/
+
+/*small enough that the checks cover feeding zlib in several pieces*/
+#define LODEPNG_ZLIB_PIECE 65536u
+#include "lodepng.c"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#define BENCH_NSEC 300000000LL
+
+static int checks;
+static int failures;
+
+static void check(const char* what, int ok)
+{
+  checks++;
+  if(!ok)
+  {
+    failures++;
+    printf("FAIL %s\n", what);
+  }
+}
+
+static long long now_nsec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*deterministic pseudo random bytes, so that failures can be reproduced*/
+static unsigned random_state = 1;
+
+static unsigned random_next(void)
+{
+  random_state = random_state * 1103515245u + 12345u;
+  return random_state >> 16;
+}
+
+static void random_bytes(unsigned char* out, size_t size)
+{
+  size_t i;
+  for(i = 0; i < size; i++) out[i] = (unsigned char)random_next();
+}
+
+/*an RGBA image of smooth gradients with some noise, like a photo*/
+static unsigned char* make_image(unsigned w, unsigned h)
+{
+  unsigned char* image = (unsigned char*)malloc((size_t)w * h * 4);
+  unsigned x, y;
+  for(y = 0; y < h; y++)
+  for(x = 0; x < w; x++)
+  {
+    unsigned char* p = &image[((size_t)y * w + x) * 4];
+    p[0] = (unsigned char)(x * 255 / w + random_next() % 8);
+    p[1] = (unsigned char)(y * 255 / h + random_next() % 8);
+    p[2] = (unsigned char)((x + y) * 127 / (w + h) + random_next() % 8);
+    p[3] = (unsigned char)(255 - random_next() % 4);
+  }
+  return image;
+}
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / CPU levels                                                             / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+typedef struct CpuLevel
+{
+  const char* name;
+  unsigned features;
+} CpuLevel;
+
+#ifdef LODEPNG_SIMD_X86
+static const CpuLevel cpu_levels[] = {
+  {"portable", 0},
+  {"sse2", LODEPNG_CPU_SSE2},
+  {"ssse3", LODEPNG_CPU_SSE2 | LODEPNG_CPU_SSSE3},
+  {"avx2", LODEPNG_CPU_SSE2 | LODEPNG_CPU_SSSE3 | LODEPNG_CPU_AVX2},
+  {"pclmul", LODEPNG_CPU_SSE2 | LODEPNG_CPU_PCLMUL}
+};
+
+/*makes lodepng use the given code path, returns 0 if the CPU can't run it*/
+static int cpu_level_use(const CpuLevel* level)
+{
+  static unsigned detected = 0;
+  if(!detected) detected = lodepng_cpu_features();
+  if((level->features & detected) != level->features) return 0;
+  lodepng_cpu_features_cached = level->features | LODEPNG_CPU_DETECTED;
+  return 1;
+}
+#else /*LODEPNG_SIMD_X86*/
+static const CpuLevel cpu_levels[] = {
+  {"portable", 0}
+};
+
+static int cpu_level_use(const CpuLevel* level)
+{
+  (void)level;
+  return 1;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#define NUM_CPU_LEVELS (sizeof(cpu_levels) / sizeof(cpu_levels[0]))
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Filters                                                                / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*
+Every SIMD level must filter RGBA lines exactly like the portable code, and unfilter them back
+to the original line, also in place
+*/
+static void check_filters(void)
+{
+  const size_t maxlength = 4100;
+  unsigned char* line = (unsigned char*)malloc(maxlength);
+  unsigned char* prev = (unsigned char*)malloc(maxlength);
+  unsigned char* expected = (unsigned char*)malloc(maxlength);
+  unsigned char* filtered = (unsigned char*)malloc(maxlength);
+  unsigned char* recon = (unsigned char*)malloc(maxlength);
+  char what[128];
+  size_t length, l;
+  unsigned char type;
+
+  for(length = 4; length <= maxlength; length += length < 256 ? 4 : 52)
+  for(type = 1; type <= 4; type++)
+  {
+    random_bytes(line, length);
+    random_bytes(prev, length);
+    cpu_level_use(&cpu_levels[0]);
+    filterScanline(expected, line, prev, length, 4, type);
+
+    for(l = 0; l < NUM_CPU_LEVELS; l++)
+    {
+      if(!cpu_level_use(&cpu_levels[l])) continue;
+      filterScanline(filtered, line, prev, length, 4, type);
+      sprintf(what, "filter type %u, %u bytes, %s", type, (unsigned)length, cpu_levels[l].name);
+      check(what, !memcmp(filtered, expected, length));
+
+      unfilterScanline(recon, expected, prev, 4, type, length);
+      sprintf(what, "unfilter type %u, %u bytes, %s", type, (unsigned)length, cpu_levels[l].name);
+      check(what, !memcmp(recon, line, length));
+
+      memcpy(recon, expected, length);
+      unfilterScanline(recon, recon, prev, 4, type, length);
+      sprintf(what, "unfilter in place type %u, %u bytes, %s", type, (unsigned)length, cpu_levels[l].name);
+      check(what, !memcmp(recon, line, length));
+    }
+  }
+
+  /*whole images still round-trip*/
+  for(l = 0; l < NUM_CPU_LEVELS; l++)
+  {
+    unsigned char* image = make_image(97, 61);
+    unsigned char* png = 0;
+    unsigned char* decoded = 0;
+    size_t pngsize = 0;
+    unsigned w = 0, h = 0;
+    if(!cpu_level_use(&cpu_levels[l])) continue;
+    sprintf(what, "png round trip, %s", cpu_levels[l].name);
+    check(what, !lodepng_encode32(&png, &pngsize, image, 97, 61)
+                && !lodepng_decode32(&decoded, &w, &h, png, pngsize)
+                && w == 97 && h == 61 && !memcmp(decoded, image, 97 * 61 * 4));
+    free(decoded);
+    free(png);
+    free(image);
+  }
+  cpu_level_use(&cpu_levels[0]);
+
+  free(recon);
+  free(filtered);
+  free(expected);
+  free(prev);
+  free(line);
+}
+
+static void bench_filters(unsigned w, unsigned h)
+{
+  static const char* names[] = {"", "Sub", "Up", "Average", "Paeth"};
+  size_t linebytes = (size_t)w * 4;
+  unsigned char* image = make_image(w, h);
+  unsigned char* filtered = (unsigned char*)malloc(linebytes * h);
+  unsigned char* recon = (unsigned char*)malloc(linebytes * h);
+  size_t l, y;
+  unsigned char type;
+
+  printf("PNG filters on a %ux%u RGBA image, MB/s:\n", w, h);
+  printf("  %-10s %-8s %10s %10s\n", "", "", "filter", "unfilter");
+  for(l = 0; l < NUM_CPU_LEVELS; l++)
+  {
+    if(!cpu_level_use(&cpu_levels[l])) continue;
+    if(cpu_levels[l].features & ~(LODEPNG_CPU_SSE2 | LODEPNG_CPU_SSSE3 | LODEPNG_CPU_AVX2)) continue;
+    for(type = 1; type <= 4; type++)
+    {
+      long long start = now_nsec(), filter_nsec, unfilter_nsec;
+      int runs = 0, i;
+      do
+      {
+        for(y = 1; y < h; y++)
+        {
+          filterScanline(&filtered[y * linebytes], &image[y * linebytes], &image[(y - 1) * linebytes],
+                         linebytes, 4, type);
+        }
+        runs++;
+      }
+      while((filter_nsec = now_nsec() - start) < BENCH_NSEC);
+      filter_nsec /= runs;
+
+      memcpy(recon, image, linebytes);
+      start = now_nsec();
+      for(i = 0; i < runs; i++)
+      {
+        for(y = 1; y < h; y++)
+        {
+          unfilterScanline(&recon[y * linebytes], &filtered[y * linebytes], &recon[(y - 1) * linebytes],
+                           4, type, linebytes);
+        }
+      }
+      unfilter_nsec = (now_nsec() - start) / runs;
+      check("unfiltered benchmark image", !memcmp(recon, image, linebytes * h));
+
+      printf("  %-10s %-8s %10.0f %10.0f\n", cpu_levels[l].name, names[type],
+             (double)linebytes * (h - 1) * 1000 / filter_nsec, (double)linebytes * (h - 1) * 1000 / unfilter_nsec);
+    }
+  }
+  cpu_level_use(&cpu_levels[0]);
+
+  free(recon);
+  free(filtered);
+  free(image);
+}
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Checksums                                                              / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*the CRC32 of the PNG specification, one byte at a time with a table built here*/
+static unsigned reference_crc32(const unsigned char* buf, size_t len)
+{
+  static unsigned table[256];
+  static int table_ready = 0;
+  unsigned c = 0xffffffffu;
+  size_t i;
+  if(!table_ready)
+  {
+    unsigned n, k;
+    for(n = 0; n < 256; n++)
+    {
+      c = n;
+      for(k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      table[n] = c;
+    }
+    table_ready = 1;
+    c = 0xffffffffu;
+  }
+  for(i = 0; i < len; i++) c = table[(c ^ buf[i]) & 0xff] ^ (c >> 8);
+  return c ^ 0xffffffffu;
+}
+
+/*Adler-32 as RFC 1950 defines it, with a modulo after every byte*/
+static unsigned reference_adler32(unsigned adler, const unsigned char* buf, size_t len)
+{
+  unsigned s1 = adler & 0xffff, s2 = adler >> 16;
+  size_t i;
+  for(i = 0; i < len; i++)
+  {
+    s1 = (s1 + buf[i]) % 65521;
+    s2 = (s2 + s1) % 65521;
+  }
+  return (s2 << 16) | s1;
+}
+
+/*
+Every code path must compute the same CRC32 and Adler-32 as the references, for all lengths
+around the vector and block sizes, at every alignment, and for long runs of 0xff, which
+come closest to overflowing the Adler-32 sums between two modulo reductions
+*/
+static void check_checksums(void)
+{
+  const size_t bigsize = 16 << 20;
+  unsigned char* buf = (unsigned char*)malloc(bigsize + 32);
+  char what[128];
+  size_t length, align, l;
+  unsigned crc, adler;
+
+  random_bytes(buf, bigsize + 32);
+  for(length = 0; length < 3000; length++)
+  for(align = 0; align < 4; align++)
+  {
+    crc = reference_crc32(&buf[align], length);
+    adler = reference_adler32(1, &buf[align], length);
+    for(l = 0; l < NUM_CPU_LEVELS; l++)
+    {
+      if(!cpu_level_use(&cpu_levels[l])) continue;
+      sprintf(what, "crc32 of %u bytes at offset %u, %s", (unsigned)length, (unsigned)align, cpu_levels[l].name);
+      check(what, lodepng_crc32(&buf[align], length) == crc);
+      sprintf(what, "adler32 of %u bytes at offset %u, %s", (unsigned)length, (unsigned)align, cpu_levels[l].name);
+      check(what, adler32_checksum(&buf[align], (unsigned)length) == adler);
+    }
+  }
+
+  for(l = 0; l < NUM_CPU_LEVELS; l++)
+  {
+    unsigned split;
+    if(!cpu_level_use(&cpu_levels[l])) continue;
+
+    random_bytes(buf, bigsize);
+    sprintf(what, "crc32 of 16 MiB of random bytes, %s", cpu_levels[l].name);
+    check(what, lodepng_crc32(buf, bigsize) == reference_crc32(buf, bigsize));
+    sprintf(what, "adler32 of 16 MiB of random bytes, %s", cpu_levels[l].name);
+    check(what, adler32_checksum(buf, (unsigned)bigsize) == reference_adler32(1, buf, bigsize));
+
+    /*continuing from a checksum that isn't the initial one*/
+    for(split = 1; split < 20000; split = split * 3 + 1)
+    {
+      sprintf(what, "adler32 continued after %u bytes, %s", split, cpu_levels[l].name);
+      check(what, update_adler32(adler32_checksum(buf, split), &buf[split], 100000)
+                  == reference_adler32(1, buf, split + 100000));
+    }
+
+    memset(buf, 0xff, bigsize);
+    sprintf(what, "crc32 of 16 MiB of 0xff, %s", cpu_levels[l].name);
+    check(what, lodepng_crc32(buf, bigsize) == reference_crc32(buf, bigsize));
+    sprintf(what, "adler32 of 16 MiB of 0xff, %s", cpu_levels[l].name);
+    check(what, adler32_checksum(buf, (unsigned)bigsize) == reference_adler32(1, buf, bigsize));
+  }
+  cpu_level_use(&cpu_levels[0]);
+
+  free(buf);
+}
+
+static void bench_checksums(void)
+{
+  const size_t size = 65536;
+  unsigned char* buf = (unsigned char*)malloc(size);
+  volatile unsigned sink = 0;
+  size_t l;
+  random_bytes(buf, size);
+
+  printf("checksums of 64 KiB, MB/s:\n");
+  printf("  %-10s %10s %10s\n", "", "crc32", "adler32");
+  for(l = 0; l < NUM_CPU_LEVELS + 1; l++)
+  {
+    long long start, crc_nsec, adler_nsec;
+    int runs;
+    if(l > 0 && !cpu_level_use(&cpu_levels[l - 1])) continue;
+
+    start = now_nsec();
+    runs = 0;
+    do
+    {
+      sink ^= l ? lodepng_crc32(buf, size) : reference_crc32(buf, size);
+      runs++;
+    }
+    while((crc_nsec = now_nsec() - start) < BENCH_NSEC);
+    crc_nsec /= runs;
+
+    start = now_nsec();
+    runs = 0;
+    do
+    {
+      sink ^= l ? adler32_checksum(buf, (unsigned)size) : reference_adler32(1, buf, size);
+      runs++;
+    }
+    while((adler_nsec = now_nsec() - start) < BENCH_NSEC);
+    adler_nsec /= runs;
+
+    printf("  %-10s %10.0f %10.0f\n", l ? cpu_levels[l - 1].name : "bytewise",
+           (double)size * 1000 / crc_nsec, (double)size * 1000 / adler_nsec);
+  }
+  cpu_level_use(&cpu_levels[0]);
+  (void)sink;
+
+  free(buf);
+}
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Zlib backend                                                           / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+#if defined(LODEPNG_USE_LIBDEFLATE)
+#define ZLIB_BACKEND_NAME "libdeflate"
+#elif defined(LODEPNG_USE_ZLIB)
+#define ZLIB_BACKEND_NAME "zlib"
+#else
+#define ZLIB_BACKEND_NAME "builtin"
+#endif
+
+/*setting these makes lodepng_zlib_compress and lodepng_zlib_decompress use the built in code*/
+static unsigned builtin_inflate(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize,
+                                const LodePNGDecompressSettings* settings)
+{
+  return lodepng_inflate(out, outsize, in, insize, settings);
+}
+
+static unsigned builtin_deflate(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize,
+                                const LodePNGCompressSettings* settings)
+{
+  return lodepng_deflate(out, outsize, in, insize, settings);
+}
+
+/*
+The configured backend and the built in code must read each other's zlib streams, for inputs
+larger than one LODEPNG_ZLIB_PIECE too, and reject a wrong Adler-32
+*/
+static void check_zlib_backend(void)
+{
+  static const size_t sizes[] = {0, 1, 1000, 65536, 3 * 65536 + 123, 1 << 20};
+  LodePNGCompressSettings backend_c = lodepng_default_compress_settings;
+  LodePNGCompressSettings builtin_c = lodepng_default_compress_settings;
+  LodePNGDecompressSettings backend_d = lodepng_default_decompress_settings;
+  LodePNGDecompressSettings builtin_d = lodepng_default_decompress_settings;
+  unsigned char* data = (unsigned char*)malloc(1 << 20);
+  char what[128];
+  size_t s;
+  int kind;
+  builtin_c.custom_deflate = builtin_deflate;
+  builtin_d.custom_inflate = builtin_inflate;
+
+  for(kind = 0; kind < 3; kind++)
+  for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+  {
+    const LodePNGCompressSettings* compress[2];
+    const LodePNGDecompressSettings* decompress[2];
+    int c, d;
+    compress[0] = &backend_c; compress[1] = &builtin_c;
+    decompress[0] = &backend_d; decompress[1] = &builtin_d;
+    if(kind == 0) random_bytes(data, sizes[s]);
+    else if(kind == 1) memset(data, 0, sizes[s]);
+    else
+    {
+      unsigned char* image = make_image(512, 512);
+      memcpy(data, image, sizes[s]);
+      free(image);
+    }
+
+    for(c = 0; c < 2; c++)
+    {
+      unsigned char* zdata = 0;
+      size_t zsize = 0;
+      sprintf(what, "compress %u bytes of kind %d with %s", (unsigned)sizes[s], kind, c ? "builtin" : ZLIB_BACKEND_NAME);
+      check(what, !lodepng_zlib_compress(&zdata, &zsize, data, sizes[s], compress[c]));
+      for(d = 0; d < 2; d++)
+      {
+        unsigned char* plain = 0;
+        size_t plainsize = 0;
+        sprintf(what, "decompress %u bytes of kind %d from %s with %s", (unsigned)sizes[s], kind,
+                c ? "builtin" : ZLIB_BACKEND_NAME, d ? "builtin" : ZLIB_BACKEND_NAME);
+        check(what, !lodepng_zlib_decompress(&plain, &plainsize, zdata, zsize, decompress[d])
+                    && plainsize == sizes[s] && (!plainsize || !memcmp(plain, data, plainsize)));
+        free(plain);
+      }
+      if(zsize > 0)
+      {
+        unsigned char* plain = 0;
+        size_t plainsize = 0;
+        zdata[zsize - 1] ^= 1;
+        sprintf(what, "wrong adler32 of %u bytes of kind %d", (unsigned)sizes[s], kind);
+        check(what, lodepng_zlib_decompress(&plain, &plainsize, zdata, zsize, &backend_d) != 0);
+        free(plain);
+      }
+      free(zdata);
+    }
+  }
+
+  free(data);
+}
+
+static void bench_zlib_backend(void)
+{
+  LodePNGCompressSettings compress[2];
+  LodePNGDecompressSettings decompress[2];
+  unsigned w = 1024, h = 1024;
+  size_t linebytes = (size_t)w * 4, size = (linebytes + 1) * h, y;
+  unsigned char* image = make_image(w, h);
+  unsigned char* filtered = (unsigned char*)malloc(size);
+  int b;
+  /*what the encoder hands to zlib: Paeth filtered lines, each after its filter type byte*/
+  for(y = 0; y < h; y++)
+  {
+    filtered[y * (linebytes + 1)] = 4;
+    filterScanline(&filtered[y * (linebytes + 1) + 1], &image[y * linebytes], y ? &image[(y - 1) * linebytes] : 0,
+                   linebytes, 4, 4);
+  }
+  compress[0] = compress[1] = lodepng_default_compress_settings;
+  decompress[0] = decompress[1] = lodepng_default_decompress_settings;
+  compress[1].custom_deflate = builtin_deflate;
+  decompress[1].custom_inflate = builtin_inflate;
+
+  printf("zlib streams of a filtered %ux%u RGBA image, MB/s of uncompressed data:\n", w, h);
+  printf("  %-12s %10s %10s %10s\n", "", "compress", "decompress", "ratio");
+  for(b = 0; b < 2; b++)
+  {
+    unsigned char* zdata = 0;
+    size_t zsize = 0;
+    long long start = now_nsec(), compress_nsec, decompress_nsec;
+    int runs = 0;
+    do
+    {
+      free(zdata);
+      zdata = 0;
+      zsize = 0;
+      check("benchmark compress", !lodepng_zlib_compress(&zdata, &zsize, filtered, size, &compress[b]));
+      runs++;
+    }
+    while((compress_nsec = now_nsec() - start) < BENCH_NSEC);
+    compress_nsec /= runs;
+
+    start = now_nsec();
+    runs = 0;
+    do
+    {
+      unsigned char* plain = 0;
+      size_t plainsize = 0;
+      check("benchmark decompress", !lodepng_zlib_decompress(&plain, &plainsize, zdata, zsize, &decompress[b])
+                                    && plainsize == size);
+      free(plain);
+      runs++;
+    }
+    while((decompress_nsec = now_nsec() - start) < BENCH_NSEC);
+    decompress_nsec /= runs;
+
+    printf("  %-12s %10.0f %10.0f %10.2f\n", b ? "builtin" : ZLIB_BACKEND_NAME,
+           (double)size * 1000 / compress_nsec, (double)size * 1000 / decompress_nsec, (double)size / zsize);
+    free(zdata);
+  }
+
+  free(filtered);
+  free(image);
+}
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Inflate                                                                / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*
+A reference inflater that walks each canonical Huffman code one bit at a time, as lodepng
+did before it decoded through tables. It shares no code with lodepng.
+*/
+typedef struct ReferenceInflate
+{
+  const unsigned char* in;
+  size_t insize, bp;
+  unsigned char* out;
+  size_t outsize, outpos;
+} ReferenceInflate;
+
+typedef struct ReferenceCode
+{
+  short count[16]; /*number of codes of each length*/
+  short symbol[288]; /*symbols ordered by code*/
+} ReferenceCode;
+
+/*returns -1 past the end of the input*/
+static int reference_bits(ReferenceInflate* s, unsigned n)
+{
+  int value = 0;
+  unsigned i;
+  if(s->bp + n > s->insize * 8) return -1;
+  for(i = 0; i < n; i++, s->bp++) value |= ((s->in[s->bp >> 3] >> (s->bp & 7)) & 1) << i;
+  return value;
+}
+
+/*returns the symbol, or -1 for a truncated stream or a code that isn't in the tree*/
+static int reference_decode(ReferenceInflate* s, const ReferenceCode* h)
+{
+  int code = 0, first = 0, index = 0, len;
+  for(len = 1; len < 16; len++)
+  {
+    int bit = reference_bits(s, 1), count;
+    if(bit < 0) return -1;
+    code |= bit;
+    count = h->count[len];
+    if(code - count < first) return h->symbol[index + (code - first)];
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+/*returns 0 for a complete code, 1 for an incomplete one, -1 for an oversubscribed one*/
+static int reference_build(ReferenceCode* h, const short* lengths, int n)
+{
+  short offs[16];
+  int symbol, len, left = 1;
+  for(len = 0; len < 16; len++) h->count[len] = 0;
+  for(symbol = 0; symbol < n; symbol++) h->count[lengths[symbol]]++;
+  if(h->count[0] == n) return 1;
+  for(len = 1; len < 16; len++)
+  {
+    left = (left << 1) - h->count[len];
+    if(left < 0) return -1;
+  }
+  offs[1] = 0;
+  for(len = 1; len < 15; len++) offs[len + 1] = offs[len] + h->count[len];
+  for(symbol = 0; symbol < n; symbol++)
+  {
+    if(lengths[symbol]) h->symbol[offs[lengths[symbol]]++] = (short)symbol;
+  }
+  return left > 0;
+}
+
+static int reference_codes(ReferenceInflate* s, const ReferenceCode* lencode, const ReferenceCode* distcode)
+{
+  static const short lbase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+                                  67, 83, 99, 115, 131, 163, 195, 227, 258};
+  static const short lext[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static const short dbase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+                                  1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+  static const short dext[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+                                 12, 12, 13, 13};
+  for(;;)
+  {
+    int symbol = reference_decode(s, lencode), extra;
+    size_t len, dist;
+    if(symbol < 0) return 1;
+    if(symbol < 256)
+    {
+      if(s->outpos == s->outsize) return 1;
+      s->out[s->outpos++] = (unsigned char)symbol;
+      continue;
+    }
+    if(symbol == 256) return 0;
+    symbol -= 257;
+    if(symbol >= 29) return 1;
+    if((extra = reference_bits(s, (unsigned)lext[symbol])) < 0) return 1;
+    len = (size_t)(lbase[symbol] + extra);
+    symbol = reference_decode(s, distcode);
+    if(symbol < 0 || symbol >= 30) return 1;
+    if((extra = reference_bits(s, (unsigned)dext[symbol])) < 0) return 1;
+    dist = (size_t)(dbase[symbol] + extra);
+    if(dist > s->outpos || len > s->outsize - s->outpos) return 1;
+    for(; len > 0; len--, s->outpos++) s->out[s->outpos] = s->out[s->outpos - dist];
+  }
+}
+
+static int reference_block(ReferenceInflate* s, int type)
+{
+  static const short order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+  ReferenceCode lencode, distcode;
+  short lengths[320];
+  int nlen, ndist, ncode, index, symbol;
+
+  if(type == 1)
+  {
+    for(symbol = 0; symbol < 144; symbol++) lengths[symbol] = 8;
+    for(; symbol < 256; symbol++) lengths[symbol] = 9;
+    for(; symbol < 280; symbol++) lengths[symbol] = 7;
+    for(; symbol < 288; symbol++) lengths[symbol] = 8;
+    reference_build(&lencode, lengths, 288);
+    for(symbol = 0; symbol < 30; symbol++) lengths[symbol] = 5;
+    reference_build(&distcode, lengths, 30);
+    return reference_codes(s, &lencode, &distcode);
+  }
+
+  if((nlen = reference_bits(s, 5)) < 0 || (ndist = reference_bits(s, 5)) < 0 || (ncode = reference_bits(s, 4)) < 0)
+  {
+    return 1;
+  }
+  nlen += 257;
+  ndist += 1;
+  ncode += 4;
+  if(nlen > 286 || ndist > 30) return 1;
+  for(index = 0; index < 19; index++)
+  {
+    int len = index < ncode ? reference_bits(s, 3) : 0;
+    if(len < 0) return 1;
+    lengths[order[index]] = (short)len;
+  }
+  if(reference_build(&lencode, lengths, 19) != 0) return 1;
+
+  for(index = 0; index < nlen + ndist;)
+  {
+    int repeat;
+    short len = 0;
+    if((symbol = reference_decode(s, &lencode)) < 0) return 1;
+    if(symbol < 16)
+    {
+      lengths[index++] = (short)symbol;
+      continue;
+    }
+    if(symbol == 16)
+    {
+      if(index == 0) return 1;
+      len = lengths[index - 1];
+      repeat = reference_bits(s, 2);
+      if(repeat >= 0) repeat += 3;
+    }
+    else if(symbol == 17)
+    {
+      repeat = reference_bits(s, 3);
+      if(repeat >= 0) repeat += 3;
+    }
+    else
+    {
+      repeat = reference_bits(s, 7);
+      if(repeat >= 0) repeat += 11;
+    }
+    if(repeat < 0 || index + repeat > nlen + ndist) return 1;
+    while(repeat-- > 0) lengths[index++] = len;
+  }
+  if(lengths[256] == 0) return 1;
+
+  /*like zlib, only a code with a single symbol may be incomplete*/
+  symbol = reference_build(&lencode, lengths, nlen);
+  if(symbol < 0 || (symbol > 0 && nlen - lencode.count[0] != 1)) return 1;
+  symbol = reference_build(&distcode, lengths + nlen, ndist);
+  if(symbol < 0 || (symbol > 0 && ndist - distcode.count[0] != 1)) return 1;
+  return reference_codes(s, &lencode, &distcode);
+}
+
+/*inflates a raw deflate stream into out, whose size must be known, returns 0 on success*/
+static int reference_inflate(unsigned char* out, size_t* outsize, const unsigned char* in, size_t insize)
+{
+  ReferenceInflate s;
+  int last, type;
+  s.in = in;
+  s.insize = insize;
+  s.bp = 0;
+  s.out = out;
+  s.outsize = *outsize;
+  s.outpos = 0;
+  do
+  {
+    if((last = reference_bits(&s, 1)) < 0 || (type = reference_bits(&s, 2)) < 0) return 1;
+    if(type == 0)
+    {
+      size_t len;
+      s.bp = (s.bp + 7) & ~(size_t)7;
+      if(s.bp / 8 + 4 > insize) return 1;
+      len = in[s.bp / 8] | (in[s.bp / 8 + 1] << 8);
+      if((len ^ 0xffff) != (size_t)(in[s.bp / 8 + 2] | (in[s.bp / 8 + 3] << 8))) return 1;
+      s.bp += 32;
+      if(s.bp / 8 + len > insize || len > s.outsize - s.outpos) return 1;
+      memcpy(&out[s.outpos], &in[s.bp / 8], len);
+      s.outpos += len;
+      s.bp += len * 8;
+    }
+    else if(type == 3 || reference_block(&s, type)) return 1;
+  }
+  while(!last);
+  *outsize = s.outpos;
+  return 0;
+}
+
+/*inflates a raw deflate stream with zlib, returns 0 on success*/
+static int zlib_inflate(unsigned char* out, size_t* outsize, const unsigned char* in, size_t insize)
+{
+  z_stream stream;
+  int result;
+  memset(&stream, 0, sizeof(stream));
+  if(inflateInit2(&stream, -15) != Z_OK) return 1;
+  stream.next_in = (unsigned char*)in;
+  stream.avail_in = (uInt)insize;
+  stream.next_out = out;
+  stream.avail_out = (uInt)*outsize;
+  result = inflate(&stream, Z_FINISH);
+  *outsize = stream.total_out;
+  inflateEnd(&stream);
+  return result != Z_STREAM_END;
+}
+
+/*compresses into a raw deflate stream, with lodepng's encoder for level < 0*/
+static void deflate_with(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize,
+                         int level, int strategy)
+{
+  *out = 0;
+  *outsize = 0;
+  if(level < 0)
+  {
+    LodePNGCompressSettings settings = lodepng_default_compress_settings;
+    settings.btype = (unsigned)(-level - 1);
+    lodepng_deflate(out, outsize, in, insize, &settings);
+  }
+  else
+  {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, level, Z_DEFLATED, -15, 8, strategy);
+    *out = (unsigned char*)malloc(deflateBound(&stream, (uLong)insize));
+    stream.next_in = (unsigned char*)in;
+    stream.avail_in = (uInt)insize;
+    stream.next_out = *out;
+    stream.avail_out = (uInt)deflateBound(&stream, (uLong)insize);
+    deflate(&stream, Z_FINISH);
+    *outsize = stream.total_out;
+    deflateEnd(&stream);
+  }
+}
+
+/*text-like bytes: words of a small vocabulary, which compress with many matches*/
+static void random_words(unsigned char* out, size_t size)
+{
+  static const char* words[] = {"the ", "png ", "filter ", "deflate ", "huffman ", "code ", "of ", "a ",
+                                "table\n", "zlib ", "stream ", "block "};
+  size_t i = 0;
+  while(i < size)
+  {
+    const char* word = words[random_next() % 12];
+    while(*word && i < size) out[i++] = (unsigned char)*word++;
+  }
+}
+
+/*
+lodepng_inflate must decode what lodepng and zlib encode exactly like the bit by bit
+reference, and whatever corrupted stream it accepts must decode like zlib decodes it
+*/
+static void check_inflate(void)
+{
+  static const int levels[][2] = {{-1, 0}, {-2, 0}, {-3, 0}, {0, Z_DEFAULT_STRATEGY}, {1, Z_DEFAULT_STRATEGY},
+                                  {6, Z_DEFAULT_STRATEGY}, {9, Z_DEFAULT_STRATEGY}, {6, Z_FILTERED},
+                                  {6, Z_HUFFMAN_ONLY}, {6, Z_RLE}, {6, Z_FIXED}};
+  const size_t maxsize = 200000;
+  LodePNGDecompressSettings settings = lodepng_default_decompress_settings;
+  unsigned char* data = (unsigned char*)malloc(maxsize);
+  unsigned char* expected = (unsigned char*)malloc(maxsize);
+  char what[128];
+  int i, accepted = 0, corrupted = 0;
+
+  for(i = 0; i < 400; i++)
+  {
+    size_t size = i < 100 ? (size_t)i : random_next() * 7 % maxsize, refsize = maxsize, zsize;
+    int kind = i % 3, level = i % (int)(sizeof(levels) / sizeof(levels[0])), c;
+    unsigned char* zdata;
+    unsigned char* out = 0;
+    size_t outsize = 0;
+    if(kind == 0) random_bytes(data, size);
+    else if(kind == 1) random_words(data, size);
+    else
+    {
+      size_t j;
+      for(j = 0; j < size; j++) data[j] = (unsigned char)(j % 251 < 200 ? j / 1000 : random_next());
+    }
+    deflate_with(&zdata, &zsize, data, size, levels[level][0], levels[level][1]);
+
+    sprintf(what, "inflate %u bytes of kind %d, level %d", (unsigned)size, kind, levels[level][0]);
+    check(what, !lodepng_inflate(&out, &outsize, zdata, zsize, &settings)
+                && !reference_inflate(expected, &refsize, zdata, zsize)
+                && outsize == size && refsize == size && !memcmp(out, data, size) && !memcmp(expected, data, size));
+    free(out);
+
+    /*flip some bits, or cut the stream short*/
+    for(c = 0; c < 50 && zsize > 0; c++)
+    {
+      unsigned char* bad = (unsigned char*)malloc(zsize);
+      size_t badsize = zsize, flips = 1 + random_next() % 3;
+      memcpy(bad, zdata, zsize);
+      if(c % 5 == 4) badsize = random_next() % zsize;
+      else while(flips-- > 0) bad[random_next() % zsize] ^= (unsigned char)(1 << (random_next() % 8));
+      out = 0;
+      outsize = 0;
+      corrupted++;
+      if(!lodepng_inflate(&out, &outsize, bad, badsize, &settings))
+      {
+        refsize = maxsize;
+        accepted++;
+        sprintf(what, "corrupted stream %d of %u bytes of kind %d, level %d", c, (unsigned)size, kind, levels[level][0]);
+        check(what, outsize <= maxsize && !zlib_inflate(expected, &refsize, bad, badsize)
+                    && refsize == outsize && !memcmp(out, expected, outsize));
+      }
+      free(out);
+      free(bad);
+    }
+    free(zdata);
+  }
+  printf("inflate accepted %d of %d corrupted streams, each like zlib\n", accepted, corrupted);
+
+  free(expected);
+  free(data);
+}
+
+static void bench_inflate(void)
+{
+  LodePNGDecompressSettings settings = lodepng_default_decompress_settings;
+  const size_t size = 4 << 20;
+  unsigned char* data = (unsigned char*)malloc(size);
+  unsigned char* out = (unsigned char*)malloc(size);
+  int kind;
+
+  printf("inflate of 4 MiB, MB/s of output:\n");
+  printf("  %-14s %10s %10s\n", "", "tables", "tree walk");
+  for(kind = 0; kind < 2; kind++)
+  {
+    unsigned char* zdata;
+    size_t zsize, outsize;
+    long long start, table_nsec, tree_nsec;
+    int runs;
+    if(kind == 0) random_words(data, size);
+    else
+    {
+      unsigned char* image = make_image(1024, 1024);
+      memcpy(data, image, size);
+      free(image);
+    }
+    deflate_with(&zdata, &zsize, data, size, 6, Z_DEFAULT_STRATEGY);
+
+    start = now_nsec();
+    runs = 0;
+    do
+    {
+      unsigned char* decoded = 0;
+      outsize = 0;
+      check("benchmark inflate", !lodepng_inflate(&decoded, &outsize, zdata, zsize, &settings) && outsize == size);
+      free(decoded);
+      runs++;
+    }
+    while((table_nsec = now_nsec() - start) < BENCH_NSEC);
+    table_nsec /= runs;
+
+    start = now_nsec();
+    runs = 0;
+    do
+    {
+      outsize = size;
+      check("benchmark reference inflate", !reference_inflate(out, &outsize, zdata, zsize) && outsize == size);
+      runs++;
+    }
+    while((tree_nsec = now_nsec() - start) < BENCH_NSEC);
+    tree_nsec /= runs;
+
+    printf("  %-14s %10.0f %10.0f\n", kind ? "image" : "text",
+           (double)size * 1000 / table_nsec, (double)size * 1000 / tree_nsec);
+    free(zdata);
+  }
+
+  free(out);
+  free(data);
+}
+
+int main(int argc, char** argv)
+{
+  if(argc > 1 && !strcmp(argv[1], "--bench"))
+  {
+    bench_filters(256, 256);
+    bench_filters(1024, 1024);
+    bench_checksums();
+    bench_inflate();
+    bench_zlib_backend();
+    return failures ? 1 : 0;
+  }
+
+  check_filters();
+  check_checksums();
+  check_inflate();
+  check_zlib_backend();
+
+  printf("%d checks, %d failures\n", checks, failures);
+  return failures ? 1 : 0;
+}
@@ -33,6 +33,26 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef HAVE_CONFIG_H
+#include "config.h" /*LODEPNG_USE_ZLIB or LODEPNG_USE_LIBDEFLATE, from configure*/
+#endif /*HAVE_CONFIG_H*/
+
+#if defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_USE_LIBDEFLATE)
+#include <string.h>
+#include <libdeflate.h>
+#elif defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_USE_ZLIB)
+#include <string.h>
+#include <zlib.h>
+#endif
+
+/*the x86 filter kernels need compiler support for per-function target attributes*/
+#if defined(LODEPNG_COMPILE_SIMD) && (defined(__x86_64__) || defined(__i386__)) \
+    && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define LODEPNG_SIMD_X86
+#include <string.h>
+#include <immintrin.h>
+#endif /*LODEPNG_SIMD_X86*/
+
 #ifdef LODEPNG_COMPILE_CPP
 #include <fstream>
 #endif /*LODEPNG_COMPILE_CPP*/
@@ -403,6 +423,37 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
 
 #endif /*LODEPNG_COMPILE_DISK*/
 
+#ifdef LODEPNG_SIMD_X86
+/*
+The instruction set extensions the SIMD code paths need, detected once at runtime. Code
+compiled for them is only called when the CPU reports them, so one binary runs everywhere.
+*/
+#define LODEPNG_CPU_SSE2 1u
+#define LODEPNG_CPU_SSSE3 2u
+#define LODEPNG_CPU_AVX2 4u
+#define LODEPNG_CPU_PCLMUL 8u /*carry-less multiply together with SSE4.1*/
+#define LODEPNG_CPU_DETECTED 0x80000000u
+
+/*file scope rather than function scope, so that lodepng-check.c can pin each code path*/
+static unsigned lodepng_cpu_features_cached = 0;
+
+static unsigned lodepng_cpu_features(void)
+{
+  unsigned features = lodepng_cpu_features_cached;
+  if(!features)
+  {
+    features = LODEPNG_CPU_DETECTED;
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) features |= LODEPNG_CPU_SSE2;
+    if(__builtin_cpu_supports("ssse3")) features |= LODEPNG_CPU_SSSE3;
+    if(__builtin_cpu_supports("avx2")) features |= LODEPNG_CPU_AVX2;
+    if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) features |= LODEPNG_CPU_PCLMUL;
+    lodepng_cpu_features_cached = features; /*every thread computes the same value, so racing here is harmless*/
+  }
+  return features;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* ////////////////////////////////////////////////////////////////////////// */
 /* // End of common code and tools. Begin of Zlib related code.            // */
@@ -436,23 +487,68 @@ static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, uns
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+Bit reader for the inflator. The bits of the deflate stream are peeked from a 64-bit
+buffer that ensureBits loads in one go, so a whole literal or length/distance pair
+(at most 15 + 5 + 15 + 13 = 48 bits) can be decoded without going back to memory.
+Past the end of the input, zero bits are read: callers compare bp against bitsize
+afterwards to detect that.
+*/
+typedef struct BitReader
+{
+  const unsigned char* data;
+  size_t size; /*size of data in bytes*/
+  size_t bitsize; /*size of data in bits, bp may not go beyond this*/
+  size_t bp; /*bit pointer, current byte is bp >> 3, current bit is bp & 7 (from lsb to msb of the byte)*/
+  unsigned long long buffer; /*at least 56 upcoming bits, starting at the lsb*/
+} BitReader;
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+static void BitReader_init(BitReader* reader, const unsigned char* data, size_t size)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  (*bitpointer)++;
-  return result;
+  reader->data = data;
+  reader->size = size;
+  reader->bitsize = size * 8;
+  reader->bp = 0;
+  reader->buffer = 0;
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+/*refills the buffer at the current bit pointer, after this at least 56 bits can be peeked and skipped*/
+static void ensureBits(BitReader* reader)
 {
-  unsigned result = 0, i;
-  for(i = 0; i < nbits; i++)
+  size_t start = reader->bp >> 3;
+  const unsigned char* p = reader->data + start;
+  unsigned long long buffer = 0;
+  if(start + 8 <= reader->size)
+  {
+    /*assembled bytewise to be independent of endianness, compilers turn this into a single load*/
+    buffer = (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) | ((unsigned long long)p[2] << 16)
+           | ((unsigned long long)p[3] << 24) | ((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40)
+           | ((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56);
+  }
+  else
   {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    (*bitpointer)++;
+    size_t i;
+    for(i = 0; start + i < reader->size; i++) buffer |= (unsigned long long)p[i] << (8 * i);
   }
+  reader->buffer = buffer >> (reader->bp & 7);
+}
+
+/*returns the next nbits bits without consuming them, nbits must be smaller than 32*/
+static unsigned peekBits(const BitReader* reader, unsigned nbits)
+{
+  return (unsigned)(reader->buffer & ((1u << nbits) - 1u));
+}
+
+static void advanceBits(BitReader* reader, unsigned nbits)
+{
+  reader->buffer >>= nbits;
+  reader->bp += nbits;
+}
+
+static unsigned readBits(BitReader* reader, unsigned nbits)
+{
+  unsigned result = peekBits(reader, nbits);
+  advanceBits(reader, nbits);
   return result;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -502,11 +598,13 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  /*decoding table, see HuffmanTree_makeTable*/
+  unsigned char* table_len; /*length of the code, or of the longest code in a second level table*/
+  unsigned short* table_value; /*the symbol, or the offset of a second level table*/
 } HuffmanTree;
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -524,77 +622,158 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
+}
+
+#ifdef LODEPNG_COMPILE_DECODER
+
+/*number of bits resolved by the first level of the decoding table, longer codes continue in a second level*/
+#define FIRSTBITS 9u
+
+/*table_len value of entries that no code fills in yet*/
+#define TABLE_UNUSED 16u
+
+/*symbol returned by huffmanDecodeSymbol for bit combinations that belong to no code*/
+#define INVALIDSYMBOL 65535u
+
+/*reverses the order of the lowest num bits, deflate stores huffman codes starting at their msb*/
+static unsigned reverseBits(unsigned bits, unsigned num)
+{
+  unsigned i, result = 0;
+  for(i = 0; i < num; i++) result |= ((bits >> (num - i - 1u)) & 1u) << i;
+  return result;
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+/*
+the table representation used by the decoder. return value is error.
+The first 2^FIRSTBITS entries are indexed by the next FIRSTBITS bits of the stream
+and give the symbol and its code length directly. Codes longer than FIRSTBITS share
+a first level entry with the other codes of the same prefix: that entry holds the
+longest of their lengths in table_len and the offset of a second level table in
+table_value, which is indexed by the bits after the first FIRSTBITS ones.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  static const unsigned headsize = 1u << FIRSTBITS;
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  size_t i, numpresent, pointer, size;
+  unsigned* maxlens = (unsigned*)lodepng_malloc(headsize * sizeof(unsigned));
+  if(!maxlens) return 83; /*alloc fail*/
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+  /*compute the size of the second level tables of each first level entry*/
+  for(i = 0; i < headsize; i++) maxlens[i] = 0;
+  for(i = 0; i < tree->numcodes; i++)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue;
+    index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(l > maxlens[index]) maxlens[index] = l;
+  }
+  size = headsize;
+  for(i = 0; i < headsize; i++)
+  {
+    if(maxlens[i] > FIRSTBITS) size += (size_t)1u << (maxlens[i] - FIRSTBITS);
+  }
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; n++)
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(unsigned char));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(unsigned short));
+  if(!tree->table_len || !tree->table_value)
+  {
+    lodepng_free(maxlens);
+    return 83; /*alloc fail*/
+  }
+  for(i = 0; i < size; i++) tree->table_len[i] = TABLE_UNUSED;
+
+  /*point the first level entries of long codes to their second level table*/
+  pointer = headsize;
+  for(i = 0; i < headsize; i++)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    unsigned l = maxlens[i];
+    if(l <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)l;
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += (size_t)1u << (l - FIRSTBITS);
   }
+  lodepng_free(maxlens);
 
-  for(n = 0; n < tree->numcodes; n++) /*the codes*/
+  /*fill in the symbols, a code shorter than its table is repeated for every value of the bits after it*/
+  numpresent = 0;
+  for(i = 0; i < tree->numcodes; i++)
   {
-    for(i = 0; i < tree->lengths[n]; i++) /*the bits for this code*/
+    unsigned l = tree->lengths[i];
+    unsigned reverse, j;
+    if(l == 0) continue;
+    reverse = reverseBits(tree->tree1d[i], l);
+    numpresent++;
+
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      if(treepos > tree->numcodes - 2) return 55; /*oversubscribed, see comment in lodepng_error_text*/
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      unsigned num = 1u << (FIRSTBITS - l);
+      for(j = 0; j < num; j++)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          nodefilled++;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        unsigned index = reverse | (j << l);
+        if(tree->table_len[index] != TABLE_UNUSED) return 55; /*oversubscribed, see comment in lodepng_error_text*/
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned index = reverse & mask;
+      unsigned maxlen = tree->table_len[index];
+      unsigned start = tree->table_value[index];
+      unsigned num;
+      if(maxlen < l) return 55; /*oversubscribed, see comment in lodepng_error_text*/
+      num = 1u << (maxlen - l);
+      for(j = 0; j < num; j++)
+      {
+        unsigned index2 = start + ((reverse >> FIRSTBITS) | (j << (l - FIRSTBITS)));
+        tree->table_len[index2] = (unsigned char)l;
+        tree->table_value[index2] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
   }
 
-  for(n = 0; n < tree->numcodes * 2; n++)
+  if(numpresent < 2)
+  {
+    /*
+    with a single code deflate still spends 1 bit on it, and a tree without codes is
+    allowed as long as its symbols never appear (e.g. unused distance codes). Either
+    way part of the table stays empty: make those entries decode to an invalid symbol.
+    */
+    for(i = 0; i < size; i++)
+    {
+      if(tree->table_len[i] == TABLE_UNUSED)
+      {
+        tree->table_len[i] = (unsigned char)(i < headsize ? 1 : FIRSTBITS + 1);
+        tree->table_value[i] = INVALIDSYMBOL;
+      }
+    }
+  }
+  else
   {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
+    /*a complete tree fills every entry, anything left means codes are missing or overlap*/
+    for(i = 0; i < size; i++)
+    {
+      if(tree->table_len[i] == TABLE_UNUSED) return 55; /*see comment in lodepng_error_text*/
+    }
   }
 
   return 0;
 }
+#endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
 Second step for the ...makeFromLengths and ...makeFromFrequencies functions.
@@ -636,8 +815,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+  return error;
 }
 
 /*
@@ -648,13 +826,17 @@ return value is error.
 static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* bitlen,
                                             size_t numcodes, unsigned maxbitlen)
 {
-  unsigned i;
+  unsigned i, error;
   tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
   if(!tree->lengths) return 83; /*alloc fail*/
   for(i = 0; i < numcodes; i++) tree->lengths[i] = bitlen[i];
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
   tree->maxbitlen = maxbitlen;
-  return HuffmanTree_makeFromLengths2(tree);
+  error = HuffmanTree_makeFromLengths2(tree);
+#ifdef LODEPNG_COMPILE_DECODER
+  if(!error) error = HuffmanTree_makeTable(tree);
+#endif /*LODEPNG_COMPILE_DECODER*/
+  return error;
 }
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -913,26 +1095,27 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 #ifdef LODEPNG_COMPILE_DECODER
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the symbol, or INVALIDSYMBOL for a bit combination that is not in the tree.
+The reader must have at least 15 bits available (see ensureBits), reading past the
+end of the input is not checked here but shows up as a bit pointer beyond bitsize.
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(BitReader* reader, const HuffmanTree* codetree)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
+  unsigned code = peekBits(reader, FIRSTBITS);
+  unsigned l = codetree->table_len[code];
+  unsigned value = codetree->table_value[code];
+  if(l <= FIRSTBITS)
   {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    (*bp)++;
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+    advanceBits(reader, l);
+    return value;
+  }
+  else
+  {
+    /*second level: value is the start of the table for the remaining bits*/
+    advanceBits(reader, FIRSTBITS);
+    value += peekBits(reader, l - FIRSTBITS);
+    advanceBits(reader, codetree->table_len[value] - FIRSTBITS);
+    return codetree->table_value[value];
   }
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -952,13 +1135,11 @@ static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d, BitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
   unsigned* bitlen_ll = 0; /*lit,len code lengths*/
@@ -967,27 +1148,31 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) >> 3 >= inlength - 2) return 49; /*error: the bit pointer is or will go past the memory*/
+  if(reader->bp + 14 > reader->bitsize) return 49; /*error: the bit pointer is or will go past the memory*/
+  ensureBits(reader);
 
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  readBits(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = readBits(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
+  HCLEN = readBits(reader, 4) + 4;
 
   HuffmanTree_init(&tree_cl);
 
   while(!error)
   {
     /*read the code length codes out of 3 * (amount of code length codes) bits*/
+    if(reader->bp + HCLEN * 3 > reader->bitsize) ERROR_BREAK(50); /*error: the bit pointer is or will go past the memory*/
 
     bitlen_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(unsigned));
     if(!bitlen_cl) ERROR_BREAK(83 /*alloc fail*/);
 
+    ensureBits(reader); /*the up to 57 bits are read in two halves*/
     for(i = 0; i < NUM_CODE_LENGTH_CODES; i++)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      if(i == 10) ensureBits(reader);
+      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
 
@@ -1005,7 +1190,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code;
+      ensureBits(reader); /*a code length code and its repeat bits need at most 7 + 7 bits*/
+      code = huffmanDecodeSymbol(reader, &tree_cl);
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1017,10 +1204,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
         unsigned replength = 3; /*read in the 2 bits that indicate repeat length (3-6)*/
         unsigned value; /*set value to the previous code*/
 
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        if(reader->bp >= reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
         if (i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        replength += readBitsFromStream(bp, in, 2);
+        replength += readBits(reader, 2);
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -1036,9 +1223,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        if(reader->bp >= reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
-        replength += readBitsFromStream(bp, in, 3);
+        replength += readBits(reader, 3);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; n++)
@@ -1053,9 +1240,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        if(reader->bp >= reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
-        replength += readBitsFromStream(bp, in, 7);
+        replength += readBits(reader, 7);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; n++)
@@ -1067,17 +1254,14 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
           i++;
         }
       }
-      else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+      else /*if(code == INVALIDSYMBOL)*/
       {
-        if(code == (unsigned)(-1))
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
-        }
-        else error = 16; /*unexisting code, this can never happen*/
+        /*return error code 10 or 11 depending on whether the input ran out or the code is not in the tree
+        (10=no endcode, 11=wrong jump outside of tree)*/
+        error = reader->bp > reader->bitsize ? 10 : 11;
         break;
       }
+      if(reader->bp > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumped past memory*/
     }
     if(error) break;
 
@@ -1100,24 +1284,26 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 }
 
 /*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+static unsigned inflateHuffmanBlock(ucvector* out, BitReader* reader, size_t* pos, unsigned btype)
 {
   unsigned error = 0;
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
   HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
 
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
 
   if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
+  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    unsigned code_ll;
+    ensureBits(reader); /*enough for a literal, or a length and distance with their extra bits*/
+    code_ll = huffmanDecodeSymbol(reader, &tree_ll);
+    /*past the end the reader returns zero bits, which may decode to a valid symbol*/
+    if(reader->bp > reader->bitsize) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
     if(code_ll <= 255) /*literal symbol*/
     {
       /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
@@ -1136,18 +1322,18 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      if(reader->bp >= reader->bitsize) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
+      length += readBits(reader, numextrabits_l);
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      code_d = huffmanDecodeSymbol(reader, &tree_d);
       if(code_d > 29)
       {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+        if(code_d == INVALIDSYMBOL)
         {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
+          /*return error code 10 or 11 depending on whether the input ran out or the code is not in the tree
           (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
+          error = reader->bp > reader->bitsize ? 10 : 11;
         }
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
@@ -1156,9 +1342,10 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 4: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
+      if(reader->bp >= reader->bitsize) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
 
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      distance += readBits(reader, numextrabits_d);
+      if(reader->bp > reader->bitsize) ERROR_BREAK(51); /*error, bit pointer jumped past memory*/
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
       start = (*pos);
@@ -1166,23 +1353,18 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
       backward = start - distance;
 
       if(!ucvector_resize(out, (*pos) + length)) ERROR_BREAK(83 /*alloc fail*/);
-      for(forward = 0; forward < length; forward++)
-      {
-        out->data[(*pos)] = out->data[backward];
-        (*pos)++;
-        backward++;
-        if(backward >= start) backward = start - distance;
-      }
+      /*copying forward one byte at a time also repeats the pattern when distance < length*/
+      for(forward = 0; forward < length; forward++) out->data[(*pos)++] = out->data[backward++];
     }
     else if(code_ll == 256)
     {
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else /*if(code_ll == INVALIDSYMBOL)*/
     {
-      /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
+      /*return error code 10 or 11 depending on whether the input ran out or the code is not in the tree
       (10=no endcode, 11=wrong jump outside of tree)*/
-      error = (*bp) > inlength * 8 ? 10 : 11;
+      error = reader->bp > reader->bitsize ? 10 : 11;
       break;
     }
   }
@@ -1193,16 +1375,17 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, BitReader* reader, size_t* pos)
 {
   /*go to first boundary of byte*/
   size_t p;
+  size_t inlength = reader->size;
+  const unsigned char* in = reader->data;
   unsigned LEN, NLEN, n, error = 0;
-  while(((*bp) & 0x7) != 0) (*bp)++;
-  p = (*bp) / 8; /*byte position*/
+  p = (reader->bp + 7) / 8; /*byte position*/
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(p >= inlength - 4) return 52; /*error, bit pointer will jump past memory*/
+  if(p + 4 > inlength) return 52; /*error, bit pointer will jump past memory*/
   LEN = in[p] + 256u * in[p + 1]; p += 2;
   NLEN = in[p] + 256u * in[p + 1]; p += 2;
 
@@ -1215,7 +1398,7 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
   for(n = 0; n < LEN; n++) out->data[(*pos)++] = in[p++];
 
-  (*bp) = p * 8;
+  reader->bp = p * 8;
 
   return error;
 }
@@ -1224,25 +1407,26 @@ static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
                                  const LodePNGDecompressSettings* settings)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
+  BitReader reader;
   unsigned BFINAL = 0;
   size_t pos = 0; /*byte position in the out buffer*/
   unsigned error = 0;
 
   (void)settings;
 
+  BitReader_init(&reader, in, insize);
+
   while(!BFINAL)
   {
     unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1u * readBitFromStream(&bp, in);
-    BTYPE += 2u * readBitFromStream(&bp, in);
+    if(reader.bp + 2 >= reader.bitsize) return 52; /*error, bit pointer will jump past memory*/
+    ensureBits(&reader);
+    BFINAL = readBits(&reader, 1);
+    BTYPE = readBits(&reader, 2);
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else if(BTYPE == 0) error = inflateNoCompression(out, &reader, &pos); /*no compression*/
+    else error = inflateHuffmanBlock(out, &reader, &pos, BTYPE); /*compression, BTYPE 01 or 10*/
 
     if(error) return error;
   }
@@ -1263,9 +1447,9 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
   return error;
 }
 
-static unsigned inflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGDecompressSettings* settings)
+static unsigned inflate_data(unsigned char** out, size_t* outsize,
+                             const unsigned char* in, size_t insize,
+                             const LodePNGDecompressSettings* settings)
 {
   if(settings->custom_inflate)
   {
@@ -1621,19 +1805,20 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final)
 {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
   size_t i, j, numdeflateblocks = (datasize + 65534) / 65535;
   unsigned datapos = 0;
+  if(numdeflateblocks == 0 && final) numdeflateblocks = 1; /*an empty final block still ends the stream*/
   for(i = 0; i < numdeflateblocks; i++)
   {
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
@@ -1994,7 +2179,7 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   Hash hash;
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize, 1);
   else if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
@@ -2037,9 +2222,9 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
   return error;
 }
 
-static unsigned deflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGCompressSettings* settings)
+static unsigned deflate_data(unsigned char** out, size_t* outsize,
+                             const unsigned char* in, size_t insize,
+                             const LodePNGCompressSettings* settings)
 {
   if(settings->custom_deflate)
   {
@@ -2057,10 +2242,115 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                  */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+#ifdef LODEPNG_SIMD_X86
+/*
+Adler-32 over whole 32-byte blocks, with at most 5552 bytes between the modulo reductions
+like the portable code. Per block, psadbw adds the bytes to s1 and pmaddubsw weighs them
+32..1 for s2. s2 also gains 32 times the s1 of the start of every block, which is summed
+separately in ps and added at the end of each run. Returns the updated checksum, the
+caller handles the remaining len % 32 bytes.
+*/
+__attribute__((target("ssse3")))
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, size_t blocks)
+{
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+
+  while(blocks > 0)
+  {
+    size_t n = blocks < 5552 / 32 ? blocks : 5552 / 32;
+    __m128i ps = _mm_cvtsi32_si128((int)(s1 * n));
+    __m128i v2 = _mm_cvtsi32_si128((int)s2);
+    __m128i v1 = zero;
+    blocks -= n;
+    while(n-- > 0)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)&data[0]);
+      __m128i b = _mm_loadu_si128((const __m128i*)&data[16]);
+      ps = _mm_add_epi32(ps, v1);
+      v1 = _mm_add_epi32(v1, _mm_add_epi32(_mm_sad_epu8(a, zero), _mm_sad_epu8(b, zero)));
+      v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(a, tap1), ones));
+      v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(b, tap2), ones));
+      data += 32;
+    }
+    v2 = _mm_add_epi32(v2, _mm_slli_epi32(ps, 5));
+    v1 = _mm_add_epi32(v1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v1 = _mm_add_epi32(v1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(2, 3, 0, 1)));
+    v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(1, 0, 3, 2)));
+    v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(2, 3, 0, 1)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(v1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(v2) % 65521;
+  }
+  return (s2 << 16) | s1;
+}
+
+/*the same with one 32-byte vector per block*/
+__attribute__((target("avx2")))
+static unsigned update_adler32_avx2(unsigned adler, const unsigned char* data, size_t blocks)
+{
+  const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                       16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+
+  while(blocks > 0)
+  {
+    size_t n = blocks < 5552 / 32 ? blocks : 5552 / 32;
+    __m256i ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+    __m256i v2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+    __m256i v1 = zero;
+    __m128i h1, h2;
+    blocks -= n;
+    while(n-- > 0)
+    {
+      __m256i a = _mm256_loadu_si256((const __m256i*)data);
+      ps = _mm256_add_epi32(ps, v1);
+      v1 = _mm256_add_epi32(v1, _mm256_sad_epu8(a, zero));
+      v2 = _mm256_add_epi32(v2, _mm256_madd_epi16(_mm256_maddubs_epi16(a, tap), ones));
+      data += 32;
+    }
+    v2 = _mm256_add_epi32(v2, _mm256_slli_epi32(ps, 5));
+    h1 = _mm_add_epi32(_mm256_castsi256_si128(v1), _mm256_extracti128_si256(v1, 1));
+    h2 = _mm_add_epi32(_mm256_castsi256_si128(v2), _mm256_extracti128_si256(v2, 1));
+    h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(1, 0, 3, 2)));
+    h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(2, 3, 0, 1)));
+    h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(1, 0, 3, 2)));
+    h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(2, 3, 0, 1)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(h1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(h2) % 65521;
+  }
+  return (s2 << 16) | s1;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
 static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
 {
-   unsigned s1 = adler & 0xffff;
-   unsigned s2 = (adler >> 16) & 0xffff;
+   unsigned s1;
+   unsigned s2;
+
+#ifdef LODEPNG_SIMD_X86
+  if(len >= 64)
+  {
+    unsigned features = lodepng_cpu_features();
+    if(features & (LODEPNG_CPU_AVX2 | LODEPNG_CPU_SSSE3))
+    {
+      size_t blocks = len / 32;
+      if(features & LODEPNG_CPU_AVX2) adler = update_adler32_avx2(adler, data, blocks);
+      else adler = update_adler32_ssse3(adler, data, blocks);
+      data += blocks * 32;
+      len -= (unsigned)(blocks * 32);
+    }
+  }
+#endif /*LODEPNG_SIMD_X86*/
+
+  s1 = adler & 0xffff;
+  s2 = (adler >> 16) & 0xffff;
 
   while(len > 0)
   {
@@ -2081,11 +2371,154 @@ static unsigned update_adler32(unsigned adler, const unsigned char* data, unsign
 }
 
 /*Return the adler32 of the bytes data[0..len-1]*/
-static unsigned adler32(const unsigned char* data, unsigned len)
+static unsigned adler32_checksum(const unsigned char* data, unsigned len)
 {
   return update_adler32(1L, data, len);
 }
 
+#if defined(LODEPNG_USE_LIBDEFLATE) || defined(LODEPNG_USE_ZLIB)
+/*
+zlib streams can be handed to libdeflate or the system zlib instead of the deflate code
+above, both are several times faster. The built in code is still used when a custom_inflate
+or custom_deflate is set, and for ignore_adler32, which neither library can do. Output is
+appended to *out like the built in functions do.
+*/
+#define LODEPNG_ZLIB_BACKEND
+
+/*zlib counts in uInt, so it is fed at most this many bytes per call. lodepng-check.c lowers it.*/
+#ifndef LODEPNG_ZLIB_PIECE
+#define LODEPNG_ZLIB_PIECE 0x40000000u
+#endif /*LODEPNG_ZLIB_PIECE*/
+
+/*reserves room for at least extra more bytes after *outsize, returns 0 on alloc fail*/
+static unsigned char* zlib_backend_grow(unsigned char** out, size_t* capacity, size_t outsize, size_t extra)
+{
+  size_t newsize = outsize + extra;
+  unsigned char* data;
+  if(newsize < outsize) return 0; /*overflow*/
+  if(newsize <= *capacity) return *out;
+  data = (unsigned char*)lodepng_realloc(*out, newsize);
+  if(!data) return 0;
+  *out = data;
+  *capacity = newsize;
+  return data;
+}
+
+#ifdef LODEPNG_COMPILE_DECODER
+static unsigned zlib_backend_decompress(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize)
+{
+  size_t capacity = *outsize;
+  /*guess the usual PNG compression ratio, and grow from there*/
+  size_t step = insize < 4096 ? 16384 : insize * 4;
+#ifdef LODEPNG_USE_LIBDEFLATE
+  struct libdeflate_decompressor* d = libdeflate_alloc_decompressor();
+  unsigned error = 0;
+  if(!d) return 83; /*alloc fail*/
+  for(;;)
+  {
+    size_t actual = 0;
+    enum libdeflate_result result;
+    if(!zlib_backend_grow(out, &capacity, *outsize, step)) { error = 83; break; }
+    result = libdeflate_zlib_decompress(d, in, insize, *out + *outsize, capacity - *outsize, &actual);
+    if(result == LIBDEFLATE_SUCCESS) { *outsize += actual; break; }
+    if(result != LIBDEFLATE_INSUFFICIENT_SPACE) { error = 91; break; }
+    step *= 2;
+  }
+  libdeflate_free_decompressor(d);
+  return error;
+#else /*LODEPNG_USE_ZLIB*/
+  z_stream stream;
+  int result = Z_OK;
+  memset(&stream, 0, sizeof(stream));
+  if(inflateInit(&stream) != Z_OK) return 83; /*alloc fail*/
+  stream.next_in = (unsigned char*)in;
+  while(result == Z_OK)
+  {
+    size_t avail;
+    if(*outsize == capacity)
+    {
+      if(!zlib_backend_grow(out, &capacity, *outsize, step)) { inflateEnd(&stream); return 83; }
+      step *= 2;
+    }
+    avail = capacity - *outsize;
+    if(avail > LODEPNG_ZLIB_PIECE) avail = LODEPNG_ZLIB_PIECE;
+    if(insize - (size_t)(stream.next_in - in) > LODEPNG_ZLIB_PIECE) stream.avail_in = LODEPNG_ZLIB_PIECE;
+    else stream.avail_in = (uInt)(insize - (size_t)(stream.next_in - in));
+    stream.next_out = *out + *outsize;
+    stream.avail_out = (uInt)avail;
+    result = inflate(&stream, Z_NO_FLUSH);
+    *outsize += avail - stream.avail_out;
+    if(result == Z_BUF_ERROR && stream.avail_out == 0) result = Z_OK; /*only out of room*/
+  }
+  inflateEnd(&stream);
+  if(result == Z_MEM_ERROR) return 83;
+  return result == Z_STREAM_END ? 0 : 91;
+#endif /*LODEPNG_USE_LIBDEFLATE*/
+}
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+#ifdef LODEPNG_COMPILE_ENCODER
+/*the built in encoder trades speed for size through the window size, the libraries through a level*/
+static int zlib_backend_level(const LodePNGCompressSettings* settings)
+{
+  if(settings->btype == 0) return 0;
+  if(!settings->use_lz77 || settings->windowsize <= 256) return 1;
+  if(settings->windowsize <= 1024) return 3;
+  if(settings->windowsize < 32768) return 6;
+  return 9;
+}
+
+static unsigned zlib_backend_compress(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize,
+                                      const LodePNGCompressSettings* settings)
+{
+  size_t capacity = *outsize;
+  int level = zlib_backend_level(settings);
+#ifdef LODEPNG_USE_LIBDEFLATE
+  struct libdeflate_compressor* c = libdeflate_alloc_compressor(level);
+  size_t written;
+  if(!c) return 83; /*alloc fail*/
+  if(!zlib_backend_grow(out, &capacity, *outsize, libdeflate_zlib_compress_bound(c, insize)))
+  {
+    libdeflate_free_compressor(c);
+    return 83;
+  }
+  written = libdeflate_zlib_compress(c, in, insize, *out + *outsize, capacity - *outsize);
+  libdeflate_free_compressor(c);
+  if(!written) return 83; /*can't happen with the bound above*/
+  *outsize += written;
+  return 0;
+#else /*LODEPNG_USE_ZLIB*/
+  z_stream stream;
+  int strategy = settings->btype == 1 ? Z_FIXED : (settings->use_lz77 ? Z_DEFAULT_STRATEGY : Z_HUFFMAN_ONLY);
+  int result;
+  if((uLong)insize != insize) return 77; /*integer overflow*/
+  memset(&stream, 0, sizeof(stream));
+  if(deflateInit2(&stream, level, Z_DEFLATED, 15, 8, strategy) != Z_OK) return 83; /*alloc fail*/
+  if(!zlib_backend_grow(out, &capacity, *outsize, deflateBound(&stream, (uLong)insize)))
+  {
+    deflateEnd(&stream);
+    return 83;
+  }
+  stream.next_in = (unsigned char*)in;
+  stream.next_out = *out + *outsize;
+  do
+  {
+    /*the bound above leaves room for all output, only the pieces are limited*/
+    size_t left = insize - (size_t)(stream.next_in - in);
+    size_t avail = capacity - (size_t)(stream.next_out - *out);
+    stream.avail_in = (uInt)(left > LODEPNG_ZLIB_PIECE ? LODEPNG_ZLIB_PIECE : left);
+    stream.avail_out = (uInt)(avail > LODEPNG_ZLIB_PIECE ? LODEPNG_ZLIB_PIECE : avail);
+    result = deflate(&stream, left > LODEPNG_ZLIB_PIECE ? Z_NO_FLUSH : Z_FINISH);
+  }
+  while(result == Z_OK);
+  *outsize = (size_t)(stream.next_out - *out);
+  deflateEnd(&stream);
+  return result == Z_STREAM_END ? 0 : 83;
+#endif /*LODEPNG_USE_LIBDEFLATE*/
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+#endif /*defined(LODEPNG_USE_LIBDEFLATE) || defined(LODEPNG_USE_ZLIB)*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2098,6 +2531,10 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
   unsigned error = 0;
   unsigned CM, CINFO, FDICT;
 
+#ifdef LODEPNG_ZLIB_BACKEND
+  if(!settings->custom_inflate && !settings->ignore_adler32) return zlib_backend_decompress(out, outsize, in, insize);
+#endif /*LODEPNG_ZLIB_BACKEND*/
+
   if(insize < 2) return 53; /*error, size of zlib data too small*/
   /*read information from zlib header*/
   if((in[0] * 256 + in[1]) % 31 != 0)
@@ -2124,13 +2561,13 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
     return 26;
   }
 
-  error = inflate(out, outsize, in + 2, insize - 2, settings);
+  error = inflate_data(out, outsize, in + 2, insize - 2, settings);
   if(error) return error;
 
   if(!settings->ignore_adler32)
   {
     unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
-    unsigned checksum = adler32(*out, (unsigned)(*outsize));
+    unsigned checksum = adler32_checksum(*out, (unsigned)(*outsize));
     if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
   }
 
@@ -2174,17 +2611,21 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   unsigned FCHECK = 31 - CMFFLG % 31;
   CMFFLG += FCHECK;
 
+#ifdef LODEPNG_ZLIB_BACKEND
+  if(!settings->custom_deflate) return zlib_backend_compress(out, outsize, in, insize, settings);
+#endif /*LODEPNG_ZLIB_BACKEND*/
+
   /*ucvector-controlled version of the output buffer, for dynamic array*/
   ucvector_init_buffer(&outv, *out, *outsize);
 
   ucvector_push_back(&outv, (unsigned char)(CMFFLG / 256));
   ucvector_push_back(&outv, (unsigned char)(CMFFLG % 256));
 
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+  error = deflate_data(&deflatedata, &deflatesize, in, insize, settings);
 
   if(!error)
   {
-    ADLER32 = adler32(in, (unsigned)insize);
+    ADLER32 = adler32_checksum(in, (unsigned)insize);
     for(i = 0; i < deflatesize; i++) ucvector_push_back(&outv, deflatedata[i]);
     lodepng_free(deflatedata);
     lodepng_add32bitInt(&outv, ADLER32);
@@ -2210,6 +2651,194 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
   }
 }
 
+#ifdef LODEPNG_COMPILE_PNG
+/*
+Incremental zlib compressor for the streaming PNG encoder: data is added in pieces and the
+finished part of the compressed stream can be taken out after each one, so neither the input
+nor the output has to be in memory as a whole. With LODEPNG_USE_ZLIB this is a z_stream. The
+built in deflater compresses every ZLIBSTREAM_SEGMENT bytes as their own deflate block(s),
+keeping one window of earlier input so matches still reach back into the previous segment.
+Custom deflate or zlib functions only work on whole buffers and are not used here.
+*/
+#define ZLIBSTREAM_SEGMENT 65536
+
+typedef struct ZlibStream
+{
+  LodePNGCompressSettings settings;
+  ucvector out; /*compressed data, the first "ready" bytes of it are final*/
+  size_t ready;
+  unsigned use_zlib; /*compress with the zlib library instead of the built in deflater*/
+#ifdef LODEPNG_USE_ZLIB
+  z_stream stream;
+#endif /*LODEPNG_USE_ZLIB*/
+  /*the rest is only used by the built in deflater*/
+  Hash hash;
+  ucvector window; /*the last window of compressed input, followed by the input not compressed yet*/
+  size_t pending; /*start of the not yet compressed input in window*/
+  size_t bp; /*bit pointer in out, out may end with a partially filled byte*/
+  unsigned adler;
+} ZlibStream;
+
+static unsigned zlibstream_init(ZlibStream* z, const LodePNGCompressSettings* settings)
+{
+  /*the same zlib header as lodepng_zlib_compress writes*/
+  unsigned CMFFLG = 256 * 120;
+  CMFFLG += 31 - CMFFLG % 31;
+
+  z->settings = *settings;
+  ucvector_init(&z->out);
+  ucvector_init(&z->window);
+  z->ready = 0;
+  z->use_zlib = 0;
+  z->pending = 0;
+  z->bp = 0;
+  z->adler = 1;
+
+#ifdef LODEPNG_USE_ZLIB
+  if(!settings->custom_deflate)
+  {
+    int strategy = settings->btype == 1 ? Z_FIXED : (settings->use_lz77 ? Z_DEFAULT_STRATEGY : Z_HUFFMAN_ONLY);
+    z->use_zlib = 1;
+    memset(&z->stream, 0, sizeof(z->stream));
+    if(deflateInit2(&z->stream, zlib_backend_level(settings), Z_DEFLATED, 15, 8, strategy) != Z_OK) return 83;
+    return 0;
+  }
+#endif /*LODEPNG_USE_ZLIB*/
+
+  CERROR_TRY_RETURN(hash_init(&z->hash, settings->windowsize));
+  if(!ucvector_push_back(&z->out, (unsigned char)(CMFFLG / 256))
+  || !ucvector_push_back(&z->out, (unsigned char)(CMFFLG % 256))) return 83; /*alloc fail*/
+  z->bp = 16;
+  return 0;
+}
+
+static void zlibstream_cleanup(ZlibStream* z)
+{
+#ifdef LODEPNG_USE_ZLIB
+  if(z->use_zlib) deflateEnd(&z->stream);
+#endif /*LODEPNG_USE_ZLIB*/
+  if(!z->use_zlib) hash_cleanup(&z->hash);
+  ucvector_cleanup(&z->out);
+  ucvector_cleanup(&z->window);
+}
+
+/*compresses window from pending up to end with the built in deflater*/
+static unsigned zlibstream_deflate(ZlibStream* z, size_t end, unsigned final)
+{
+  unsigned error = 0;
+  if(z->settings.btype == 0)
+  {
+    /*stored blocks only ever end on a byte boundary*/
+    error = deflateNoCompression(&z->out, &z->window.data[z->pending], end - z->pending, final);
+    z->bp = z->out.size * 8;
+  }
+  else if(z->settings.btype == 1)
+  {
+    error = deflateFixed(&z->out, &z->bp, &z->hash, z->window.data, z->pending, end, &z->settings, final);
+  }
+  else
+  {
+    error = deflateDynamic(&z->out, &z->bp, &z->hash, z->window.data, z->pending, end, &z->settings, final);
+  }
+  z->pending = end;
+  return error;
+}
+
+/*adds size bytes of input, final must be set for the last piece and ends the zlib stream*/
+static unsigned zlibstream_add(ZlibStream* z, const unsigned char* data, size_t size, unsigned final)
+{
+  unsigned error = 0;
+  size_t i, keepstart;
+
+#ifdef LODEPNG_USE_ZLIB
+  if(z->use_zlib)
+  {
+    z->stream.next_in = (unsigned char*)data;
+    for(;;)
+    {
+      int result;
+      size_t avail;
+      /*feed at most 1GB at a time, avail_in may be only 32-bit*/
+      if(z->stream.avail_in == 0 && size > 0)
+      {
+        z->stream.avail_in = (uInt)(size < 1073741824u ? size : 1073741824u);
+        size -= z->stream.avail_in;
+      }
+      if(!ucvector_reserve(&z->out, z->out.size + 16384)) return 83; /*alloc fail*/
+      avail = z->out.allocsize - z->out.size;
+      z->stream.next_out = &z->out.data[z->out.size];
+      z->stream.avail_out = (uInt)(avail < 1073741824u ? avail : 1073741824u);
+      avail = z->stream.avail_out;
+      result = deflate(&z->stream, (final && size == 0) ? Z_FINISH : Z_NO_FLUSH);
+      z->out.size += avail - z->stream.avail_out;
+      if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) return 83;
+      if(result == Z_STREAM_END) break;
+      if(!final && size == 0 && z->stream.avail_in == 0 && z->stream.avail_out != 0) break;
+    }
+    z->ready = z->out.size;
+    return 0;
+  }
+#endif /*LODEPNG_USE_ZLIB*/
+
+  if(!ucvector_reserve(&z->window, z->window.size + size)) return 83; /*alloc fail*/
+  for(i = 0; i < size; i++) z->window.data[z->window.size + i] = data[i];
+  z->window.size += size;
+  for(i = 0; i < size; i += 1073741824u)
+  {
+    size_t amount = size - i < 1073741824u ? size - i : 1073741824u;
+    z->adler = update_adler32(z->adler, &data[i], (unsigned)amount);
+  }
+
+  /*compress whole segments, and at the end whatever is left*/
+  while(!error)
+  {
+    size_t end = z->window.size;
+    unsigned last = final;
+    if(end - z->pending > ZLIBSTREAM_SEGMENT)
+    {
+      end = z->pending + ZLIBSTREAM_SEGMENT;
+      last = 0;
+    }
+    else if(!final && end - z->pending < ZLIBSTREAM_SEGMENT) break; /*wait for more input*/
+    error = zlibstream_deflate(z, end, last);
+    if(last || end == z->window.size) break;
+  }
+  if(error) return error;
+
+  /*
+  drop input that matches can't reach anymore. The hash only stores positions modulo
+  the window size, so the data is moved by a multiple of it to keep those valid
+  */
+  keepstart = z->pending >= z->settings.windowsize
+            ? (z->pending - z->settings.windowsize) / z->settings.windowsize * z->settings.windowsize : 0;
+  if(keepstart > 0)
+  {
+    for(i = keepstart; i < z->window.size; i++) z->window.data[i - keepstart] = z->window.data[i];
+    z->window.size -= keepstart;
+    z->pending -= keepstart;
+  }
+
+  if(final)
+  {
+    lodepng_add32bitInt(&z->out, z->adler);
+    z->ready = z->out.size;
+  }
+  else z->ready = z->bp / 8;
+
+  return 0;
+}
+
+/*removes the first "ready" bytes of the output, after they have been written elsewhere*/
+static void zlibstream_consume(ZlibStream* z)
+{
+  size_t i;
+  for(i = z->ready; i < z->out.size; i++) z->out.data[i - z->ready] = z->out.data[i];
+  z->out.size -= z->ready;
+  if(!z->use_zlib) z->bp -= z->ready * 8;
+  z->ready = 0;
+}
+#endif /*LODEPNG_COMPILE_PNG*/
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #else /*no LODEPNG_COMPILE_ZLIB*/
@@ -2287,51 +2916,389 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0,
 /* / CRC32                                                                  / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-/* CRC polynomial: 0xedb88320 */
-static unsigned lodepng_crc32_table[256] = {
-           0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
-   249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
-   498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
-   325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
-   997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
-   901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
-   651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
-   671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
-  1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
-  2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
-  1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
-  1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
-  1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
-  1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
-  1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
-  1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
-  3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
-  3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
-  4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
-  4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
-  3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
-  3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
-  3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
-  3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
-  2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
-  2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
-  2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
-  2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
-  2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
-  2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
-  3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
-  3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+/*
+CRC polynomial: 0xedb88320. Table 0 is the classic byte-at-a-time table, table k gives the
+CRC contribution of a byte followed by k zero bytes, so that lodepng_crc32 can fold 8 input
+bytes per step with 8 independent lookups ("slicing-by-8").
+*/
+static const unsigned lodepng_crc32_table[8][256] = {
+  {
+             0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
+     249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
+     498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
+     325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
+     997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
+     901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
+     651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
+     671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
+    1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
+    2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
+    1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
+    1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
+    1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
+    1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
+    1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
+    1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
+    3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
+    3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
+    4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
+    4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
+    3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
+    3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
+    3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
+    3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
+    2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
+    2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
+    2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
+    2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
+    2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
+    2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
+    3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
+    3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+  },
+  {
+             0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+    3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+    1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+    2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+    2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+    1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+    3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+     396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+    4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+     950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+    3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+    1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+    1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+    2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+     792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+    3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+     998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+    4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+    1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+    3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+    2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+    1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+    3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+     740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+    3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+      52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+    2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+    1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+    1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+    2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+     347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+    3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+             0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+     236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+     472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+     305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+     944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+     912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+     611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+     712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+    1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+    2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+    1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+    1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+    1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+    1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+    1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+    1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+    3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+    4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+    4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+    4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+    3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+    3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+    3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+    3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+    2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+    2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+    2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+    2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+    2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+    2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+    3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+    3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+             0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+    3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+    1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+    2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+    2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+    1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+    4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+     899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+    2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+    1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+    3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+     247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+     992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+    4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+    1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+    2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+    3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+     686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+    3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+    2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+    1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+    2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+     494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+    3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+    1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+    3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+     643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+    3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+    3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+     332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+    2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+    1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+             0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+     812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+    1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+    1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+    3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+    4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+    2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+    2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+    1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+    1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+     940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+     140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+    2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+    2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+    4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+    3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+    2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+    2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+    3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+    3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+    1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+    1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+     281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+     548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+    3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+    3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+    2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+    3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+     685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+     413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+    1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+    2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+             0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+    3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+      64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+    4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+     128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+    3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+      75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+    3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+     257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+    3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+     210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+    3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+     150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+    3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+     186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+    3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+     514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+    4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+     493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+    4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+     421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+    4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+     449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+    4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+     300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+    4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+     306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+    4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+     373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+    4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+     361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+    4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+             0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+     871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+    1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+    1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+    3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+    4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+    2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+    2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+    1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+    2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+     601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+     272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+    2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+    3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+    3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+    3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+    2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+    3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+    4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+    3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+    1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+    1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+     544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+     328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+    3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+    4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+    2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+    2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+      60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+     810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+    1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+    1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+             0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+    3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+    2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+    2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+    4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+     714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+    2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+    1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+     698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+    4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+    1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+    2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+    3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+      51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+    2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+    2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+    1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+    2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+     796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+    4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+    2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+    2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+    3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+      85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+    2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+    2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+     102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+    3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+    2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+    1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+    4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+     747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
 };
 
+#ifdef LODEPNG_SIMD_X86
+/*
+CRC of len bytes by folding 64 bytes at a time with carry-less multiplication, then a Barrett
+reduction to 32 bits, as in Intel's "Fast CRC Computation for Generic Polynomials Using
+PCLMULQDQ Instruction". The constants are for the bit-reflected polynomial 0xedb88320.
+len must be at least 64 and a multiple of 16, c is the running CRC register (not inverted).
+*/
+__attribute__((target("pclmul,sse4.1")))
+static unsigned lodepng_crc32_pclmul(unsigned c, const unsigned char* buf, size_t len)
+{
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&buf[0]), _mm_cvtsi32_si128((int)c));
+  x2 = _mm_loadu_si128((const __m128i*)&buf[16]);
+  x3 = _mm_loadu_si128((const __m128i*)&buf[32]);
+  x4 = _mm_loadu_si128((const __m128i*)&buf[48]);
+  buf += 64;
+  len -= 64;
+
+  /*fold four 128-bit lanes in parallel*/
+  while(len >= 64)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), x5);
+    x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), x6);
+    x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), x7);
+    x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), x8);
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)&buf[0]));
+    x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i*)&buf[16]));
+    x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i*)&buf[32]));
+    x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i*)&buf[48]));
+    buf += 64;
+    len -= 64;
+  }
+
+  /*fold the four lanes into one, then the remaining 16-byte blocks into that*/
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+  while(len >= 16)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_loadu_si128((const __m128i*)buf));
+    x1 = _mm_xor_si128(x1, x5);
+    buf += 16;
+    len -= 16;
+  }
+
+  /*128 to 64 bits*/
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /*Barrett reduction to 32 bits*/
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (unsigned)_mm_extract_epi32(x1, 1);
+}
+#endif /*LODEPNG_SIMD_X86*/
+
 /*Return the CRC of the bytes buf[0..len-1].*/
 unsigned lodepng_crc32(const unsigned char* buf, size_t len)
 {
   unsigned c = 0xffffffffL;
-  size_t n;
 
-  for(n = 0; n < len; n++)
+#ifdef LODEPNG_SIMD_X86
+  if(len >= 64 && (lodepng_cpu_features() & LODEPNG_CPU_PCLMUL))
   {
-    c = lodepng_crc32_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    size_t blocks = len & ~(size_t)15;
+    c = lodepng_crc32_pclmul(c, buf, blocks);
+    buf += blocks;
+    len -= blocks;
+  }
+#endif /*LODEPNG_SIMD_X86*/
+
+  while(len >= 8)
+  {
+    c ^= buf[0] | ((unsigned)buf[1] << 8) | ((unsigned)buf[2] << 16) | ((unsigned)buf[3] << 24);
+    c = lodepng_crc32_table[7][c & 0xff] ^ lodepng_crc32_table[6][(c >> 8) & 0xff]
+      ^ lodepng_crc32_table[5][(c >> 16) & 0xff] ^ lodepng_crc32_table[4][(c >> 24) & 0xff]
+      ^ lodepng_crc32_table[3][buf[4]] ^ lodepng_crc32_table[2][buf[5]]
+      ^ lodepng_crc32_table[1][buf[6]] ^ lodepng_crc32_table[0][buf[7]];
+    buf += 8;
+    len -= 8;
+  }
+  while(len > 0)
+  {
+    c = lodepng_crc32_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    len--;
   }
   return c ^ 0xffffffffL;
 }
@@ -3745,49 +4712,412 @@ static unsigned char paethPredictor(short a, short b, short c)
   else return (unsigned char)a;
 }
 
-/*shared values used by multiple Adam7 related functions*/
+#ifdef LODEPNG_SIMD_X86
+/*
+SIMD versions of the Sub, Up, Average and Paeth filters for 4 bytes per pixel (8-bit RGBA),
+which is what nearly all stickers and avatars are. The encoder filters are independent per
+byte and process 16 (SSE2, SSSE3) or 32 (AVX2) bytes at a time. In the decoder, Sub, Average
+and Paeth depend on the pixel just reconstructed, so those work on one pixel at a time with
+all four channels in parallel, and only Up uses full vectors. SSSE3 adds pabsw for Paeth.
+The portable code remains the reference for everything else.
+*/
 
-static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
-static const unsigned ADAM7_IY[7] = { 0, 0, 4, 0, 2, 0, 1 }; /*y start values*/
-static const unsigned ADAM7_DX[7] = { 8, 8, 4, 4, 2, 2, 1 }; /*x delta values*/
-static const unsigned ADAM7_DY[7] = { 8, 8, 8, 4, 4, 2, 2 }; /*y delta values*/
+/*floor((a + b) / 2) per byte: pavgb rounds up, so subtract the lost low bit*/
+__attribute__((target("sse2")))
+static __m128i simd_average_sse2(__m128i a, __m128i b)
+{
+  return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
 
 /*
-Outputs various dimensions and positions in the image related to the Adam7 reduced images.
-passw: output containing the width of the 7 passes
-passh: output containing the height of the 7 passes
-filter_passstart: output containing the index of the start and end of each
- reduced image with filter bytes
-padded_passstart output containing the index of the start and end of each
- reduced image when without filter bytes but with padded scanlines
-passstart: output containing the index of the start and end of each reduced
- image without padding between scanlines, but still padding between the images
-w, h: width and height of non-interlaced image
-bpp: bits per pixel
-"padded" is only relevant if bpp is less than 8 and a scanline or image does not
- end at a full byte
+Paeth predictor on 8 lanes of 16 bits holding values 0-255, the same choice as paethPredictor:
+a if pa is the smallest distance, else b if pb is, else c.
 */
-static void Adam7_getpassvalues(unsigned passw[7], unsigned passh[7], size_t filter_passstart[8],
-                                size_t padded_passstart[8], size_t passstart[8], unsigned w, unsigned h, unsigned bpp)
+__attribute__((target("sse2")))
+static __m128i simd_paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(pa, pb);
+  __m128i smallest, mask, result;
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+  smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  mask = _mm_cmpeq_epi16(smallest, pb);
+  result = _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, c));
+  mask = _mm_cmpeq_epi16(smallest, pa);
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, result));
+}
+
+__attribute__((target("ssse3")))
+static __m128i simd_paeth_ssse3(__m128i a, __m128i b, __m128i c)
+{
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+  __m128i smallest, mask, result;
+  pa = _mm_abs_epi16(pa);
+  pb = _mm_abs_epi16(pb);
+  smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  mask = _mm_cmpeq_epi16(smallest, pb);
+  result = _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, c));
+  mask = _mm_cmpeq_epi16(smallest, pa);
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, result));
+}
+
+#ifdef LODEPNG_COMPILE_ENCODER
+__attribute__((target("avx2")))
+static __m256i simd_paeth_avx2(__m256i a, __m256i b, __m256i c)
 {
-  /*the passstart values have 8 values: the 8th one indicates the byte after the end of the 7th (= last) pass*/
-  unsigned i;
+  __m256i pa = _mm256_sub_epi16(b, c);
+  __m256i pb = _mm256_sub_epi16(a, c);
+  __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+  __m256i smallest;
+  pa = _mm256_abs_epi16(pa);
+  pb = _mm256_abs_epi16(pb);
+  smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+  c = _mm256_blendv_epi8(c, b, _mm256_cmpeq_epi16(smallest, pb));
+  return _mm256_blendv_epi8(c, a, _mm256_cmpeq_epi16(smallest, pa));
+}
 
-  /*calculate width and height in pixels of each pass*/
-  for(i = 0; i < 7; i++)
+/*portable filtering of the bytes from position i on, for 4 bytes per pixel with a previous line.
+i must be at least 4 except for Up*/
+static void filterScanlineRGBATail(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                   size_t i, size_t length, unsigned char filterType)
+{
+  switch(filterType)
   {
-    passw[i] = (w + ADAM7_DX[i] - ADAM7_IX[i] - 1) / ADAM7_DX[i];
-    passh[i] = (h + ADAM7_DY[i] - ADAM7_IY[i] - 1) / ADAM7_DY[i];
-    if(passw[i] == 0) passh[i] = 0;
-    if(passh[i] == 0) passw[i] = 0;
+    case 1: for(; i < length; i++) out[i] = scanline[i] - scanline[i - 4]; break;
+    case 2: for(; i < length; i++) out[i] = scanline[i] - prevline[i]; break;
+    case 3: for(; i < length; i++) out[i] = scanline[i] - ((scanline[i - 4] + prevline[i]) / 2); break;
+    case 4:
+      for(; i < length; i++) out[i] = scanline[i] - paethPredictor(scanline[i - 4], prevline[i], prevline[i - 4]);
+      break;
+    default: break;
   }
+}
 
-  filter_passstart[0] = padded_passstart[0] = passstart[0] = 0;
-  for(i = 0; i < 7; i++)
+/*Paeth prediction of 16 bytes: the left neighbours a, the bytes above b and the ones above-left c*/
+#define SIMD_PAETH_BYTES_128(paeth, a, b, c) _mm_packus_epi16(\
+  paeth(_mm_unpacklo_epi8(a, _mm_setzero_si128()), _mm_unpacklo_epi8(b, _mm_setzero_si128()),\
+        _mm_unpacklo_epi8(c, _mm_setzero_si128())),\
+  paeth(_mm_unpackhi_epi8(a, _mm_setzero_si128()), _mm_unpackhi_epi8(b, _mm_setzero_si128()),\
+        _mm_unpackhi_epi8(c, _mm_setzero_si128())))
+
+/*filters a whole 4-byte-per-pixel scanline with a previous line, filter types 1-4*/
+__attribute__((target("sse2")))
+static void filterScanlineSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                               size_t length, unsigned char filterType)
+{
+  size_t i = 0;
+  switch(filterType)
   {
-    /*if passw[i] is 0, it's 0 bytes, not 1 (no filtertype-byte)*/
-    filter_passstart[i + 1] = filter_passstart[i]
-                            + ((passw[i] && passh[i]) ? passh[i] * (1 + (passw[i] * bpp + 7) / 8) : 0);
+    case 1: /*Sub*/
+      for(i = 0; i < 4; i++) out[i] = scanline[i];
+      for(; i + 16 <= length; i += 16)
+      {
+        __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - 4]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, a));
+      }
+      break;
+    case 2: /*Up*/
+      for(; i + 16 <= length; i += 16)
+      {
+        __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, b));
+      }
+      break;
+    case 3: /*Average*/
+      for(i = 0; i < 4; i++) out[i] = scanline[i] - prevline[i] / 2;
+      for(; i + 16 <= length; i += 16)
+      {
+        __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - 4]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, simd_average_sse2(a, b)));
+      }
+      break;
+    case 4: /*Paeth*/
+      for(i = 0; i < 4; i++) out[i] = scanline[i] - prevline[i];
+      for(; i + 16 <= length; i += 16)
+      {
+        __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - 4]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+        __m128i c = _mm_loadu_si128((const __m128i*)&prevline[i - 4]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, SIMD_PAETH_BYTES_128(simd_paeth_sse2, a, b, c)));
+      }
+      break;
+    default: return;
+  }
+  filterScanlineRGBATail(out, scanline, prevline, i, length, filterType);
+}
+
+__attribute__((target("ssse3")))
+static void filterScanlineSSSE3(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                size_t length, unsigned char filterType)
+{
+  size_t i;
+  if(filterType != 4)
+  {
+    filterScanlineSSE2(out, scanline, prevline, length, filterType);
+    return;
+  }
+  for(i = 0; i < 4; i++) out[i] = scanline[i] - prevline[i];
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - 4]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+    __m128i c = _mm_loadu_si128((const __m128i*)&prevline[i - 4]);
+    _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, SIMD_PAETH_BYTES_128(simd_paeth_ssse3, a, b, c)));
+  }
+  filterScanlineRGBATail(out, scanline, prevline, i, length, filterType);
+}
+
+__attribute__((target("avx2")))
+static void filterScanlineAVX2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                               size_t length, unsigned char filterType)
+{
+  __m256i zero = _mm256_setzero_si256();
+  __m256i one = _mm256_set1_epi8(1);
+  size_t i;
+  /*the first pixel has no left neighbour, the 128-bit version handles it and short lines*/
+  if(length < 36)
+  {
+    filterScanlineSSSE3(out, scanline, prevline, length, filterType);
+    return;
+  }
+  filterScanlineSSSE3(out, scanline, prevline, 4, filterType);
+  for(i = 4; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+    __m256i a = _mm256_loadu_si256((const __m256i*)&scanline[i - 4]);
+    __m256i b = _mm256_loadu_si256((const __m256i*)&prevline[i]);
+    __m256i p;
+    switch(filterType)
+    {
+      case 1: p = a; break;
+      case 2: p = b; break;
+      case 3: p = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one)); break;
+      default:
+      {
+        __m256i c = _mm256_loadu_si256((const __m256i*)&prevline[i - 4]);
+        p = _mm256_packus_epi16(
+              simd_paeth_avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero),
+                              _mm256_unpacklo_epi8(c, zero)),
+              simd_paeth_avx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero),
+                              _mm256_unpackhi_epi8(c, zero)));
+        break;
+      }
+    }
+    _mm256_storeu_si256((__m256i*)&out[i], _mm256_sub_epi8(x, p));
+  }
+  filterScanlineRGBATail(out, scanline, prevline, i, length, filterType);
+}
+
+/*returns 1 if the scanline was filtered with SIMD, 0 if the portable code must do it*/
+static int filterScanlineSIMD(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                              size_t length, size_t bytewidth, unsigned char filterType)
+{
+  unsigned features;
+  if(bytewidth != 4 || !prevline || filterType < 1 || filterType > 4) return 0;
+  features = lodepng_cpu_features();
+  if(features & LODEPNG_CPU_AVX2) filterScanlineAVX2(out, scanline, prevline, length, filterType);
+  else if(features & LODEPNG_CPU_SSSE3) filterScanlineSSSE3(out, scanline, prevline, length, filterType);
+  else if(features & LODEPNG_CPU_SSE2) filterScanlineSSE2(out, scanline, prevline, length, filterType);
+  else return 0;
+  return 1;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
+#ifdef LODEPNG_COMPILE_DECODER
+__attribute__((target("sse2")))
+static __m128i simd_load4(const unsigned char* p)
+{
+  int v;
+  memcpy(&v, p, 4);
+  return _mm_cvtsi32_si128(v);
+}
+
+__attribute__((target("sse2")))
+static void simd_store4(unsigned char* p, __m128i x)
+{
+  int v = _mm_cvtsi128_si32(x);
+  memcpy(p, &v, 4);
+}
+
+/*unfilters a whole 4-byte-per-pixel scanline with a previous line, filter types 1-4, recon may equal scanline*/
+__attribute__((target("sse2")))
+static void unfilterScanlineSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t length, unsigned char filterType)
+{
+  __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  switch(filterType)
+  {
+    case 1: /*Sub: prefix sum of the pixels within each vector, plus the last pixel of the previous one*/
+    {
+      __m128i last = zero;
+      for(; i + 16 <= length; i += 16)
+      {
+        __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi8(x, last);
+        _mm_storeu_si128((__m128i*)&recon[i], x);
+        last = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+      }
+      for(; i < length; i += 4)
+      {
+        last = _mm_add_epi8(simd_load4(&scanline[i]), last);
+        simd_store4(&recon[i], last);
+      }
+      break;
+    }
+    case 2: /*Up*/
+      for(; i + 16 <= length; i += 16)
+      {
+        __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+        _mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(x, b));
+      }
+      for(; i < length; i++) recon[i] = scanline[i] + precon[i];
+      break;
+    case 3: /*Average, the missing left neighbour of the first pixel counts as 0*/
+    {
+      __m128i a = zero;
+      for(; i < length; i += 4)
+      {
+        a = _mm_add_epi8(simd_load4(&scanline[i]), simd_average_sse2(a, simd_load4(&precon[i])));
+        simd_store4(&recon[i], a);
+      }
+      break;
+    }
+    case 4: /*Paeth, a and c are kept as 16-bit lanes*/
+    {
+      __m128i a = zero, c = zero;
+      for(; i < length; i += 4)
+      {
+        __m128i b = _mm_unpacklo_epi8(simd_load4(&precon[i]), zero);
+        __m128i p = simd_paeth_sse2(a, b, c);
+        __m128i x = _mm_add_epi8(simd_load4(&scanline[i]), _mm_packus_epi16(p, p));
+        simd_store4(&recon[i], x);
+        a = _mm_unpacklo_epi8(x, zero);
+        c = b;
+      }
+      break;
+    }
+    default: break;
+  }
+}
+
+__attribute__((target("ssse3")))
+static void unfilterScanlineSSSE3(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                  size_t length, unsigned char filterType)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  size_t i;
+  if(filterType != 4)
+  {
+    unfilterScanlineSSE2(recon, scanline, precon, length, filterType);
+    return;
+  }
+  for(i = 0; i < length; i += 4)
+  {
+    __m128i b = _mm_unpacklo_epi8(simd_load4(&precon[i]), zero);
+    __m128i p = simd_paeth_ssse3(a, b, c);
+    __m128i x = _mm_add_epi8(simd_load4(&scanline[i]), _mm_packus_epi16(p, p));
+    simd_store4(&recon[i], x);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+__attribute__((target("avx2")))
+static void unfilterScanlineAVX2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t length, unsigned char filterType)
+{
+  size_t i;
+  /*only Up has no dependency along the line, the others gain nothing from wider vectors*/
+  if(filterType != 2)
+  {
+    unfilterScanlineSSSE3(recon, scanline, precon, length, filterType);
+    return;
+  }
+  for(i = 0; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i*)&precon[i]);
+    _mm256_storeu_si256((__m256i*)&recon[i], _mm256_add_epi8(x, b));
+  }
+  for(; i < length; i++) recon[i] = scanline[i] + precon[i];
+}
+
+/*returns 1 if the scanline was unfiltered with SIMD, 0 if the portable code must do it*/
+static int unfilterScanlineSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, unsigned char filterType, size_t length)
+{
+  unsigned features;
+  if(bytewidth != 4 || !precon || filterType < 1 || filterType > 4) return 0;
+  features = lodepng_cpu_features();
+  if(features & LODEPNG_CPU_AVX2) unfilterScanlineAVX2(recon, scanline, precon, length, filterType);
+  else if(features & LODEPNG_CPU_SSSE3) unfilterScanlineSSSE3(recon, scanline, precon, length, filterType);
+  else if(features & LODEPNG_CPU_SSE2) unfilterScanlineSSE2(recon, scanline, precon, length, filterType);
+  else return 0;
+  return 1;
+}
+#endif /*LODEPNG_COMPILE_DECODER*/
+#endif /*LODEPNG_SIMD_X86*/
+
+/*shared values used by multiple Adam7 related functions*/
+
+static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
+static const unsigned ADAM7_IY[7] = { 0, 0, 4, 0, 2, 0, 1 }; /*y start values*/
+static const unsigned ADAM7_DX[7] = { 8, 8, 4, 4, 2, 2, 1 }; /*x delta values*/
+static const unsigned ADAM7_DY[7] = { 8, 8, 8, 4, 4, 2, 2 }; /*y delta values*/
+
+/*
+Outputs various dimensions and positions in the image related to the Adam7 reduced images.
+passw: output containing the width of the 7 passes
+passh: output containing the height of the 7 passes
+filter_passstart: output containing the index of the start and end of each
+ reduced image with filter bytes
+padded_passstart output containing the index of the start and end of each
+ reduced image when without filter bytes but with padded scanlines
+passstart: output containing the index of the start and end of each reduced
+ image without padding between scanlines, but still padding between the images
+w, h: width and height of non-interlaced image
+bpp: bits per pixel
+"padded" is only relevant if bpp is less than 8 and a scanline or image does not
+ end at a full byte
+*/
+static void Adam7_getpassvalues(unsigned passw[7], unsigned passh[7], size_t filter_passstart[8],
+                                size_t padded_passstart[8], size_t passstart[8], unsigned w, unsigned h, unsigned bpp)
+{
+  /*the passstart values have 8 values: the 8th one indicates the byte after the end of the 7th (= last) pass*/
+  unsigned i;
+
+  /*calculate width and height in pixels of each pass*/
+  for(i = 0; i < 7; i++)
+  {
+    passw[i] = (w + ADAM7_DX[i] - ADAM7_IX[i] - 1) / ADAM7_DX[i];
+    passh[i] = (h + ADAM7_DY[i] - ADAM7_IY[i] - 1) / ADAM7_DY[i];
+    if(passw[i] == 0) passh[i] = 0;
+    if(passh[i] == 0) passw[i] = 0;
+  }
+
+  filter_passstart[0] = padded_passstart[0] = passstart[0] = 0;
+  for(i = 0; i < 7; i++)
+  {
+    /*if passw[i] is 0, it's 0 bytes, not 1 (no filtertype-byte)*/
+    filter_passstart[i + 1] = filter_passstart[i]
+                            + ((passw[i] && passh[i]) ? passh[i] * (1 + (passw[i] * bpp + 7) / 8) : 0);
     /*bits padded if needed to fill full byte at end of each scanline*/
     padded_passstart[i + 1] = padded_passstart[i] + passh[i] * ((passw[i] * bpp + 7) / 8);
     /*only padded at end of reduced image*/
@@ -3872,6 +5202,9 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+#ifdef LODEPNG_SIMD_X86
+  if(unfilterScanlineSIMD(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#endif /*LODEPNG_SIMD_X86*/
   switch(filterType)
   {
     case 0:
@@ -5008,6 +6341,9 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
                            size_t length, size_t bytewidth, unsigned char filterType)
 {
   size_t i;
+#ifdef LODEPNG_SIMD_X86
+  if(filterScanlineSIMD(out, scanline, prevline, length, bytewidth, filterType)) return;
+#endif /*LODEPNG_SIMD_X86*/
   switch(filterType)
   {
     case 0: /*None*/
@@ -5077,13 +6413,14 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+static unsigned filter(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                       unsigned w, unsigned h, const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
 {
   /*
   For PNG filter method 0
   out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
   the scanlines with 1 extra byte per scanline
+  prevline is the scanline above the first one, or 0 at the top of the image
   */
 
   unsigned bpp = lodepng_get_bpp(info);
@@ -5091,7 +6428,6 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   size_t linebytes = (w * bpp + 7) / 8;
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
   unsigned x, y;
   unsigned error = 0;
   LodePNGFilterStrategy strategy = settings->filter_strategy;
@@ -5114,14 +6450,16 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
   if(bpp == 0) return 31; /*error: invalid color type*/
 
-  if(strategy == LFS_ZERO)
+  if(strategy <= LFS_FOUR)
   {
+    /*the same filter for every scanline, LFS_ZERO to LFS_FOUR are the filter types themselves*/
+    unsigned char type = (unsigned char)strategy;
     for(y = 0; y < h; y++)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
-      out[outindex] = 0; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, 0);
+      out[outindex] = type; /*filter type byte*/
+      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
       prevline = &in[inindex];
     }
   }
@@ -5409,14 +6747,14 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         if(!error)
         {
           addPaddingBits(padded, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
-          error = filter(*out, padded, w, h, &info_png->color, settings);
+          error = filter(*out, padded, 0, w, h, &info_png->color, settings);
         }
         lodepng_free(padded);
       }
       else
       {
         /*we can immediatly filter into the out buffer, no other steps needed*/
-        error = filter(*out, in, w, h, &info_png->color, settings);
+        error = filter(*out, in, 0, w, h, &info_png->color, settings);
       }
     }
   }
@@ -5448,13 +6786,13 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
           if(!padded) ERROR_BREAK(83); /*alloc fail*/
           addPaddingBits(padded, &adam7[passstart[i]],
                          ((passw[i] * bpp + 7) / 8) * 8, passw[i] * bpp, passh[i]);
-          error = filter(&(*out)[filter_passstart[i]], padded,
+          error = filter(&(*out)[filter_passstart[i]], padded, 0,
                          passw[i], passh[i], &info_png->color, settings);
           lodepng_free(padded);
         }
         else
         {
-          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
+          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]], 0,
                          passw[i], passh[i], &info_png->color, settings);
         }
 
@@ -5508,6 +6846,114 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+/*the signature and the chunks that come before the image data*/
+static unsigned addChunksBeforeIDAT(ucvector* out, const LodePNGInfo* info, unsigned w, unsigned h,
+                                    const LodePNGEncoderSettings* settings)
+{
+  writeSignature(out);
+  /*IHDR*/
+  addChunk_IHDR(out, w, h, info->color.colortype, info->color.bitdepth, info->interlace_method);
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*unknown chunks between IHDR and PLTE*/
+  if(info->unknown_chunks_data[0])
+  {
+    CERROR_TRY_RETURN(addUnknownChunks(out, info->unknown_chunks_data[0], info->unknown_chunks_size[0]));
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  /*PLTE*/
+  if(info->color.colortype == LCT_PALETTE)
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  if(settings->force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA))
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  /*tRNS*/
+  if(info->color.colortype == LCT_PALETTE && getPaletteTranslucency(info->color.palette, info->color.palettesize) != 0)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+  if((info->color.colortype == LCT_GREY || info->color.colortype == LCT_RGB) && info->color.key_defined)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*bKGD (must come between PLTE and the IDAt chunks*/
+  if(info->background_defined) addChunk_bKGD(out, info);
+  /*pHYs (must come before the IDAT chunks)*/
+  if(info->phys_defined) addChunk_pHYs(out, info);
+
+  /*unknown chunks between PLTE and IDAT*/
+  if(info->unknown_chunks_data[1])
+  {
+    CERROR_TRY_RETURN(addUnknownChunks(out, info->unknown_chunks_data[1], info->unknown_chunks_size[1]));
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return 0;
+}
+
+/*the chunks that come after the image data, up to and including IEND*/
+static unsigned addChunksAfterIDAT(ucvector* out, const LodePNGInfo* info, LodePNGEncoderSettings* settings)
+{
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  size_t i;
+  /*tIME*/
+  if(info->time_defined) addChunk_tIME(out, &info->time);
+  /*tEXt and/or zTXt*/
+  for(i = 0; i < info->text_num; i++)
+  {
+    if(strlen(info->text_keys[i]) > 79) return 66; /*text chunk too large*/
+    if(strlen(info->text_keys[i]) < 1) return 67; /*text chunk too small*/
+    if(settings->text_compression)
+    {
+      addChunk_zTXt(out, info->text_keys[i], info->text_strings[i], &settings->zlibsettings);
+    }
+    else
+    {
+      addChunk_tEXt(out, info->text_keys[i], info->text_strings[i]);
+    }
+  }
+  /*LodePNG version id in text chunk*/
+  if(settings->add_id)
+  {
+    unsigned alread_added_id_text = 0;
+    for(i = 0; i < info->text_num; i++)
+    {
+      if(!strcmp(info->text_keys[i], "LodePNG"))
+      {
+        alread_added_id_text = 1;
+        break;
+      }
+    }
+    if(alread_added_id_text == 0)
+    {
+      addChunk_tEXt(out, "LodePNG", VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
+    }
+  }
+  /*iTXt*/
+  for(i = 0; i < info->itext_num; i++)
+  {
+    if(strlen(info->itext_keys[i]) > 79) return 66; /*text chunk too large*/
+    if(strlen(info->itext_keys[i]) < 1) return 67; /*text chunk too small*/
+    addChunk_iTXt(out, settings->text_compression,
+                  info->itext_keys[i], info->itext_langtags[i], info->itext_transkeys[i], info->itext_strings[i],
+                  &settings->zlibsettings);
+  }
+
+  /*unknown chunks between IDAT and IEND*/
+  if(info->unknown_chunks_data[2])
+  {
+    CERROR_TRY_RETURN(addUnknownChunks(out, info->unknown_chunks_data[2], info->unknown_chunks_size[2]));
+  }
+#else /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  (void)info;
+  (void)settings;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  addChunk_IEND(out);
+  return 0;
+}
+
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state)
@@ -5571,123 +7017,13 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   ucvector_init(&outv);
   while(!state->error) /*while only executed once, to break on error*/
   {
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    size_t i;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*write signature and chunks*/
-    writeSignature(&outv);
-    /*IHDR*/
-    addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks_data[0])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE)
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA))
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    /*tRNS*/
-    if(info.color.colortype == LCT_PALETTE && getPaletteTranslucency(info.color.palette, info.color.palettesize) != 0)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-    if((info.color.colortype == LCT_GREY || info.color.colortype == LCT_RGB) && info.color.key_defined)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined) addChunk_bKGD(&outv, &info);
-    /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) addChunk_pHYs(&outv, &info);
-
-    /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks_data[1])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+    state->error = addChunksBeforeIDAT(&outv, &info, w, h, &state->encoder);
+    if(state->error) break;
     /*IDAT (multiple IDAT chunks must be consecutive)*/
     state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
     if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*tIME*/
-    if(info.time_defined) addChunk_tIME(&outv, &info.time);
-    /*tEXt and/or zTXt*/
-    for(i = 0; i < info.text_num; i++)
-    {
-      if(strlen(info.text_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        break;
-      }
-      if(strlen(info.text_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        break;
-      }
-      if(state->encoder.text_compression)
-      {
-        addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
-      }
-      else
-      {
-        addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
-      }
-    }
-    /*LodePNG version id in text chunk*/
-    if(state->encoder.add_id)
-    {
-      unsigned alread_added_id_text = 0;
-      for(i = 0; i < info.text_num; i++)
-      {
-        if(!strcmp(info.text_keys[i], "LodePNG"))
-        {
-          alread_added_id_text = 1;
-          break;
-        }
-      }
-      if(alread_added_id_text == 0)
-      {
-        addChunk_tEXt(&outv, "LodePNG", VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
-      }
-    }
-    /*iTXt*/
-    for(i = 0; i < info.itext_num; i++)
-    {
-      if(strlen(info.itext_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        break;
-      }
-      if(strlen(info.itext_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        break;
-      }
-      addChunk_iTXt(&outv, state->encoder.text_compression,
-                    info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
-                    &state->encoder.zlibsettings);
-    }
-
-    /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks_data[2])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    addChunk_IEND(&outv);
+    state->error = addChunksAfterIDAT(&outv, &info, &state->encoder);
+    if(state->error) break;
 
     break; /*this isn't really a while loop; no error happened so break out now!*/
   }
@@ -5701,6 +7037,148 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   return state->error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+/*the streaming encoder collects this much compressed data before writing it as an IDAT chunk*/
+#define STREAM_IDAT_SIZE 65536
+
+/*writes the finished part of the compressed data as IDAT chunk, once there is enough or if flush is set*/
+static unsigned streamWriteIDAT(LodePNGStreamEncoder* encoder, unsigned flush)
+{
+  ZlibStream* z = (ZlibStream*)encoder->zlib;
+  ucvector chunk;
+  unsigned error;
+  if(z->ready == 0 || (!flush && z->ready < STREAM_IDAT_SIZE)) return 0;
+  ucvector_init(&chunk);
+  error = addChunk(&chunk, "IDAT", z->out.data, z->ready);
+  if(!error) error = encoder->write(chunk.data, chunk.size, encoder->context);
+  ucvector_cleanup(&chunk);
+  zlibstream_consume(z);
+  return error;
+}
+
+unsigned lodepng_stream_encoder_begin(LodePNGStreamEncoder* encoder, LodePNGState* state, unsigned w, unsigned h,
+                                      unsigned (*write)(const unsigned char* data, size_t size, void* context),
+                                      void* context)
+{
+  LodePNGInfo* info = &encoder->info;
+  ucvector outv;
+  size_t linebytes;
+
+  /*everything lodepng_stream_encoder_cleanup frees is set up first*/
+  encoder->state = state;
+  encoder->write = write;
+  encoder->context = context;
+  encoder->w = w;
+  encoder->h = h;
+  encoder->y = 0;
+  encoder->lines = 0;
+  encoder->zlib = 0;
+  lodepng_info_init(info);
+
+  state->error = lodepng_info_copy(info, &state->info_png);
+  if(state->error) return state->error;
+
+  if((info->color.colortype == LCT_PALETTE || state->encoder.force_palette)
+      && (info->color.palettesize == 0 || info->color.palettesize > 256))
+  {
+    CERROR_RETURN_ERROR(state->error, 68); /*invalid palette size, it is only allowed to be 1-256*/
+  }
+  if(state->encoder.zlibsettings.btype > 2)
+  {
+    CERROR_RETURN_ERROR(state->error, 61); /*error: unexisting btype*/
+  }
+  if(info->interlace_method > 1)
+  {
+    CERROR_RETURN_ERROR(state->error, 71); /*error: unexisting interlace mode*/
+  }
+  if(info->interlace_method == 1)
+  {
+    CERROR_RETURN_ERROR(state->error, 92); /*error: Adam7 needs the whole image*/
+  }
+  state->error = checkColorValidity(info->color.colortype, info->color.bitdepth);
+  if(state->error) return state->error; /*error: unexisting color type given*/
+  state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
+  if(state->error) return state->error; /*error: unexisting color type given*/
+
+  /*two rows in the PNG color type, the current and the previous one, and one filtered row*/
+  linebytes = ((size_t)w * lodepng_get_bpp(&info->color) + 7) / 8;
+  encoder->lines = (unsigned char*)lodepng_malloc(linebytes * 3 + 1);
+  encoder->zlib = lodepng_malloc(sizeof(ZlibStream));
+  if(!encoder->lines || !encoder->zlib)
+  {
+    lodepng_free(encoder->zlib);
+    encoder->zlib = 0;
+    CERROR_RETURN_ERROR(state->error, 83); /*alloc fail*/
+  }
+  state->error = zlibstream_init((ZlibStream*)encoder->zlib, &state->encoder.zlibsettings);
+  if(state->error) return state->error;
+
+  ucvector_init(&outv);
+  state->error = addChunksBeforeIDAT(&outv, info, w, h, &state->encoder);
+  if(!state->error) state->error = write(outv.data, outv.size, context);
+  ucvector_cleanup(&outv);
+
+  return state->error;
+}
+
+unsigned lodepng_stream_encoder_add_row(LodePNGStreamEncoder* encoder, const unsigned char* row)
+{
+  LodePNGState* state = encoder->state;
+  LodePNGEncoderSettings settings = state->encoder;
+  LodePNGColorMode* color = &encoder->info.color;
+  size_t linebytes = ((size_t)encoder->w * lodepng_get_bpp(color) + 7) / 8;
+  /*the two row buffers take turns holding the current row*/
+  unsigned char* line = &encoder->lines[(encoder->y & 1) * linebytes];
+  unsigned char* prevline = encoder->y == 0 ? 0 : &encoder->lines[((encoder->y + 1) & 1) * linebytes];
+  unsigned char* filtered = &encoder->lines[2 * linebytes];
+
+  if(state->error) return state->error;
+  if(encoder->y >= encoder->h) CERROR_RETURN_ERROR(state->error, 93); /*more rows than the image height*/
+
+  state->error = lodepng_convert(line, row, color, &state->info_raw, encoder->w, 1);
+  if(state->error) return state->error;
+
+  /*predefined filters are given for the whole image*/
+  if(settings.predefined_filters) settings.predefined_filters += encoder->y;
+  state->error = filter(filtered, line, prevline, encoder->w, 1, color, &settings);
+  if(!state->error) state->error = zlibstream_add((ZlibStream*)encoder->zlib, filtered, linebytes + 1, 0);
+  if(!state->error) state->error = streamWriteIDAT(encoder, 0);
+  if(!state->error) encoder->y++;
+
+  return state->error;
+}
+
+unsigned lodepng_stream_encoder_finish(LodePNGStreamEncoder* encoder)
+{
+  LodePNGState* state = encoder->state;
+  ucvector outv;
+
+  if(state->error) return state->error;
+  if(encoder->y != encoder->h) CERROR_RETURN_ERROR(state->error, 93); /*fewer rows than the image height*/
+
+  state->error = zlibstream_add((ZlibStream*)encoder->zlib, 0, 0, 1);
+  if(!state->error) state->error = streamWriteIDAT(encoder, 1);
+  if(state->error) return state->error;
+
+  ucvector_init(&outv);
+  state->error = addChunksAfterIDAT(&outv, &encoder->info, &state->encoder);
+  if(!state->error) state->error = encoder->write(outv.data, outv.size, encoder->context);
+  ucvector_cleanup(&outv);
+
+  return state->error;
+}
+
+void lodepng_stream_encoder_cleanup(LodePNGStreamEncoder* encoder)
+{
+  if(encoder->zlib) zlibstream_cleanup((ZlibStream*)encoder->zlib);
+  lodepng_free(encoder->zlib);
+  lodepng_free(encoder->lines);
+  lodepng_info_cleanup(&encoder->info);
+  encoder->zlib = 0;
+  encoder->lines = 0;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -5727,6 +7205,22 @@ unsigned lodepng_encode24(unsigned char** out, size_t* outsize, const unsigned c
   return lodepng_encode_memory(out, outsize, image, w, h, LCT_RGB, 8);
 }
 
+unsigned lodepng_encode32_fast(unsigned char** out, size_t* outsize, const unsigned char* image, unsigned w, unsigned h)
+{
+  unsigned error;
+  LodePNGState state;
+  lodepng_state_init(&state);
+  lodepng_encoder_settings_fast(&state.encoder);
+  state.info_raw.colortype = LCT_RGBA;
+  state.info_raw.bitdepth = 8;
+  state.info_png.color.colortype = LCT_RGBA;
+  state.info_png.color.bitdepth = 8;
+  lodepng_encode(out, outsize, image, w, h, &state);
+  error = state.error;
+  lodepng_state_cleanup(&state);
+  return error;
+}
+
 #ifdef LODEPNG_COMPILE_DISK
 unsigned lodepng_encode_file(const char* filename, const unsigned char* image, unsigned w, unsigned h,
                              LodePNGColorType colortype, unsigned bitdepth)
@@ -5764,6 +7258,18 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 }
 
+void lodepng_encoder_settings_fast(LodePNGEncoderSettings* settings)
+{
+  lodepng_encoder_settings_init(settings);
+  /*Up is the cheapest filter and compresses stickers and gradients about as well as the
+  per-scanline minimum sum search, which filters every line five times*/
+  settings->filter_strategy = LFS_TWO;
+  /*maxchainlength is windowsize / 8, so this also keeps the match search shallow*/
+  settings->zlibsettings.windowsize = 256;
+  settings->zlibsettings.nicematch = 16;
+  settings->zlibsettings.lazymatching = 0;
+}
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_PNG*/
 
@@ -5866,6 +7372,9 @@ const char* lodepng_error_text(unsigned code)
     case 89: return "text chunk keyword too short or long: must have size 1-79";
     /*the windowsize in the LodePNGCompressSettings. Requiring POT(==> & instead of %) makes encoding 12% faster.*/
     case 90: return "windowsize must be a power of two";
+    case 91: return "the zlib or libdeflate library could not decompress the data, it must be corrupted";
+    case 92: return "the streaming encoder can not do Adam7 interlacing, that needs the whole image";
+    case 93: return "the streaming encoder got a different number of rows than the image height";
   }
   return "unknown error code";
 }
@@ -65,6 +65,12 @@ the custom_zlib field of the compress and decompress settings*/
 #ifndef LODEPNG_NO_COMPILE_ANCILLARY_CHUNKS
 #define LODEPNG_COMPILE_ANCILLARY_CHUNKS
 #endif
+/*SSE2/SSSE3/AVX2 versions of the PNG filters for RGBA images, and PCLMULQDQ CRC32 and
+SSSE3/AVX2 Adler-32, chosen at runtime on x86. The portable code is always compiled as
+well and used on other CPUs and color types.*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+#define LODEPNG_COMPILE_SIMD
+#endif
 /*ability to convert error numerical codes to English text string*/
 #ifndef LODEPNG_NO_COMPILE_ERROR_TEXT
 #define LODEPNG_COMPILE_ERROR_TEXT
@@ -170,6 +176,11 @@ unsigned lodepng_encode32(unsigned char** out, size_t* outsize,
 unsigned lodepng_encode24(unsigned char** out, size_t* outsize,
                           const unsigned char* image, unsigned w, unsigned h);
 
+/*Same as lodepng_encode32, but with lodepng_encoder_settings_fast: several times faster,
+for a somewhat larger file. Meant for images that are only shown, not stored.*/
+unsigned lodepng_encode32_fast(unsigned char** out, size_t* outsize,
+                               const unsigned char* image, unsigned w, unsigned h);
+
 #ifdef LODEPNG_COMPILE_DISK
 /*
 Converts raw pixel data into a PNG file on disk.
@@ -535,7 +546,12 @@ void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings);
 typedef enum LodePNGFilterStrategy
 {
   /*every filter at zero*/
-  LFS_ZERO,
+  LFS_ZERO = 0,
+  /*every filter at 1, 2, 3 or 4 (Sub, Up, Average, Paeth): no per-scanline search at all*/
+  LFS_ONE = 1,
+  LFS_TWO = 2,
+  LFS_THREE = 3,
+  LFS_FOUR = 4,
   /*Use filter that gives minumum sum, as described in the official PNG filter heuristic.*/
   LFS_MINSUM,
   /*Use the filter type that gives smallest Shannon entropy for this scanline. Depending
@@ -610,6 +626,9 @@ typedef struct LodePNGEncoderSettings
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
+/*Initializes the settings for speed instead of size: one fixed filter (Up) for every
+scanline, and a small LZ77 window with a shallow, non-lazy match search.*/
+void lodepng_encoder_settings_fast(LodePNGEncoderSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 
@@ -663,6 +682,53 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Streaming encoder: encodes a PNG one row at a time and hands out the file while it is
+being made, so neither the whole image, nor its filtered version, nor the whole PNG have
+to be in memory. Call lodepng_stream_encoder_begin, then lodepng_stream_encoder_add_row
+for every row from top to bottom, then lodepng_stream_encoder_finish, and in any case
+lodepng_stream_encoder_cleanup at the end.
+The color types, chunks and settings come from the LodePNGState like for lodepng_encode,
+with these differences:
+*) auto_convert is ignored, it needs the whole image: info_png.color is used as given
+*) Adam7 interlacing is not supported (error 92)
+*) custom_zlib and custom_deflate can't stream and are not used, the built in deflate
+   (or zlib, when compiled with LODEPNG_USE_ZLIB) always is
+*/
+typedef struct LodePNGStreamEncoder
+{
+  /*all of this is internal, set up by lodepng_stream_encoder_begin*/
+  LodePNGState* state;
+  unsigned (*write)(const unsigned char* data, size_t size, void* context);
+  void* context;
+  unsigned w, h; /*size of the image*/
+  unsigned y; /*the number of rows added so far*/
+  LodePNGInfo info; /*copy of state->info_png*/
+  unsigned char* lines; /*the current and previous row, and the filtered row*/
+  void* zlib; /*compressor of the filtered rows*/
+} LodePNGStreamEncoder;
+
+/*
+Checks the settings and writes the PNG signature and the chunks before the image data.
+write gets every next part of the PNG file, if it returns nonzero encoding stops with
+that value as error. state must stay valid until lodepng_stream_encoder_cleanup, errors
+are also stored in state->error.
+*/
+unsigned lodepng_stream_encoder_begin(LodePNGStreamEncoder* encoder, LodePNGState* state, unsigned w, unsigned h,
+                                      unsigned (*write)(const unsigned char* data, size_t size, void* context),
+                                      void* context);
+
+/*Adds the next row: (w * bpp + 7) / 8 bytes, in the color type of state->info_raw.*/
+unsigned lodepng_stream_encoder_add_row(LodePNGStreamEncoder* encoder, const unsigned char* row);
+
+/*After all h rows were added, writes the rest of the image data and the chunks after it.*/
+unsigned lodepng_stream_encoder_finish(LodePNGStreamEncoder* encoder);
+
+/*Frees the memory of the encoder, also needed when begin failed or encoding stopped early.*/
+void lodepng_stream_encoder_cleanup(LodePNGStreamEncoder* encoder);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
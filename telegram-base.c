@@ -41,6 +41,7 @@
 #include "tgp-structs.h"
 #include "tgp-utils.h"
 #include "tgp-chat.h"
+#include "tgp-imgstore.h"
 #include "lodepng/lodepng.h"
 
 #define _(m) m
@@ -404,6 +405,13 @@ gchar *get_download_dir (struct tgl_state *TLS) {
   return dir;
 }
 
+gchar *get_cache_dir (struct tgl_state *TLS) {
+  assert (TLS->base_path);
+  gchar *dir = g_build_filename (TLS->base_path, "downloads", "cache", NULL);
+  g_mkdir_with_parents (dir, 0700);
+  return dir;
+}
+
 void assert_file_exists (PurpleConnection *gc, const char *filepath, const char *format) {
   if (!g_file_test (filepath, G_FILE_TEST_EXISTS)) {
     gchar *msg = g_strdup_printf (format, filepath);
@@ -815,12 +823,12 @@ int tgp_visualize_key (struct tgl_state *TLS, unsigned char* sha1_key) {
   }
   unsigned char* png;
   size_t pngsize;
-  unsigned error = lodepng_encode32(&png, &pngsize, image, img_size, img_size);
+  unsigned error = lodepng_encode32_fast(&png, &pngsize, image, img_size, img_size);
   int imgStoreId = -1;
   if(!error)
   {
-    imgStoreId = purple_imgstore_add_with_id (png, pngsize, NULL);
-    used_images_add ((connection_data*)TLS->ev_base, imgStoreId);
+    imgStoreId = tgp_imgstore_add_data (TLS->ev_base, png, pngsize);
+    tgp_imgstore_add (TLS->ev_base, imgStoreId, NULL);
   }
   g_free(image);
   return imgStoreId;
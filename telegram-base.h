@@ -47,6 +47,7 @@ void request_create_chat (struct tgl_state *TLS, const char *subject);
 
 gchar *get_config_dir (struct tgl_state *TLS, char const *username);
 gchar *get_download_dir (struct tgl_state *TLS);
+gchar *get_cache_dir (struct tgl_state *TLS);
 void assert_file_exists (PurpleConnection *gc, const char *filepath, const char *format);
 
 int tgp_visualize_key(struct tgl_state *TLS, unsigned char* sha1_key);
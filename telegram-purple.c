@@ -71,6 +71,8 @@
 #include "tgp-chat.h"
 #include "tgp-ft.h"
 #include "tgp-msg.h"
+#include "tgp-loader.h"
+#include "tgp-imgstore.h"
 
 static void get_password (struct tgl_state *TLS, enum tgl_value_type type, const char *prompt, int num_values,
                           void (*callback)(struct tgl_state *TLS, const char *string[], void *arg), void *arg);
@@ -204,7 +206,7 @@ static void update_user_typing (struct tgl_state *TLS, struct tgl_user *U, enum
 
 static void update_marked_read (struct tgl_state *TLS, int num, struct tgl_message *list[]) {
   connection_data *conn = TLS->ev_base;
-  if (! purple_account_get_bool (conn->pa, "display-read-notifications", FALSE)) {
+  if (! conn->settings.display_read_notifications) {
     return;
   }
   
@@ -287,6 +289,38 @@ static void on_contact_added (struct tgl_state *TLS,void *callback_extra, int su
 }
 */
 
+static void download_desc_free (gpointer data) {
+  struct download_desc *dld = data;
+  free (dld->get_user_info_data);
+  free (dld);
+}
+
+static void on_userpic_read (connection_data *conn, void *extra, gchar *data, gsize len) {
+  struct tgl_state *TLS = conn->TLS;
+  struct download_desc *dld = extra;
+  tgl_peer_t *P = tgl_peer_get (TLS, dld->get_user_info_data->peer);
+  
+  if (!data || !P) {
+    g_free (data);
+    download_desc_free (dld);
+    return;
+  }
+  
+  int imgStoreId = tgp_imgstore_add_data (conn, g_memdup (data, (guint) len), len);
+  if (imgStoreId > 0) {
+    tgp_imgstore_add (conn, imgStoreId, NULL);
+
+    p2tgl_buddy_icons_set_for_user (conn->pa, &P->id, data, len);
+    if (dld->get_user_info_data->show_info == 1) {
+      PurpleNotifyUserInfo *info = p2tgl_notify_peer_info_new (TLS, P);
+      p2tgl_notify_userinfo (TLS, P->id, info, NULL, NULL);
+    }
+  } else {
+    g_free (data);
+  }
+  download_desc_free (dld);
+}
+
 static void on_userpic_loaded (struct tgl_state *TLS, void *extra, int success, const char *filename) {
   connection_data *conn = TLS->ev_base;
   
@@ -302,19 +336,8 @@ static void on_userpic_loaded (struct tgl_state *TLS, void *extra, int success,
     return;
   }
   
-  int imgStoreId = p2tgl_imgstore_add_with_id (filename);
-  if (imgStoreId > 0) {
-    used_images_add (conn, imgStoreId);
-
-    p2tgl_buddy_icons_set_for_user (conn->pa, &P->id, filename);
-    if (dld->get_user_info_data->show_info == 1) {
-      PurpleNotifyUserInfo *info = p2tgl_notify_peer_info_new (TLS, P);
-      p2tgl_notify_userinfo (TLS, P->id, info, NULL, NULL);
-    }
-  }
-  
-  free (dld->get_user_info_data);
-  free (dld);
+  // the file is read on a worker thread
+  tgp_imgstore_load (conn, filename, on_userpic_read, dld, download_desc_free);
 }
 
 static void on_get_dialog_list_done (struct tgl_state *TLS, void *callback_extra, int success, int size,
@@ -384,7 +407,8 @@ void on_user_get_info (struct tgl_state *TLS, void *info_data, int success, stru
     struct download_desc *dld = malloc (sizeof(struct download_desc));
     dld->data = U;
     dld->get_user_info_data = info_data;
-    tgl_do_load_photo (TLS, U->photo, on_userpic_loaded, dld);
+    tgp_loader_load_photo (TLS, U->photo, user_info_data->show_info ? TGP_LOADER_INTERACTIVE : TGP_LOADER_BACKGROUND,
+                           on_userpic_loaded, dld);
   }
 }
 
@@ -572,6 +596,7 @@ static void tgprpl_login (PurpleAccount * acct) {
 
   TLS->base_path = get_config_dir(TLS, purple_account_get_username (acct));
   tgl_set_download_directory (TLS, get_download_dir(TLS));
+  conn->cache_dir = get_cache_dir (TLS);
   assert_file_exists (gc, pk_path, "Error, server public key not found at %s."
                       " Make sure that Telegram-Purple is installed properly.");
   debug ("base configuration path: '%s'", TLS->base_path);
@@ -693,9 +718,12 @@ static void tgprpl_set_status (PurpleAccount * acct, PurpleStatus * status) {
   if (!gc) { return; }
   connection_data *conn = purple_connection_get_protocol_data (gc);
 
-  int present = p2tgl_status_is_present (status);
-  if (present && p2tgl_send_notifications (acct)) {
-    pending_reads_send_all (conn->pending_reads, conn->TLS);
+  // libpurple emits no signal for changed account settings, refresh the snapshot on every status
+  // change so that changed settings are applied at the latest on the next status change or login,
+  // whether read notifications may be sent is never taken from the snapshot
+  connection_data_update_settings (conn, status);
+  if (conn->settings.present && p2tgl_send_notifications (acct)) {
+    pending_reads_send_all (conn);
   }
 }
 
@@ -754,6 +782,25 @@ static int tgprpl_send_chat (PurpleConnection * gc, int id, const char *message,
   return ret;
 }
 
+static void tgprpl_chat_leave (PurpleConnection * gc, int id) {
+  debug ("tgprpl_chat_leave()");
+  connection_data *conn = purple_connection_get_protocol_data (gc);
+  
+  // only the conversation was closed, the user is still part of the chat
+  tgp_imgstore_conversation_closed (conn, TGL_MK_CHAT (id));
+}
+
+static void tgprpl_convo_closed (PurpleConnection * gc, const char *who) {
+  debug ("tgprpl_convo_closed()");
+  connection_data *conn = purple_connection_get_protocol_data (gc);
+  
+  // IM conversations are named by the bare id of a user or a secret chat
+  tgl_peer_t *P = find_peer_by_name (conn->TLS, who);
+  if (P) {
+    tgp_imgstore_conversation_closed (conn, P->id);
+  }
+}
+
 /*
 static void tgprpl_set_buddy_icon (PurpleConnection * gc, PurpleStoredImage * img) {
   debug ("tgprpl_set_buddy_icon()");
@@ -819,7 +866,7 @@ static PurplePluginProtocolInfo prpl_info = {
   NULL,                    // reject_chat
   tgprpl_get_chat_name,
   tgprpl_chat_invite,
-  NULL,                    // chat_leave
+  tgprpl_chat_leave,
   NULL,                    // chat_whisper
   tgprpl_send_chat,
   NULL,                    // keepalive
@@ -830,7 +877,7 @@ static PurplePluginProtocolInfo prpl_info = {
   NULL,                    // group_buddy
   NULL,                    // rename_group
   NULL,                    // buddy_free
-  NULL,                    // convo_closed
+  tgprpl_convo_closed,
   NULL,                    // normalize
   NULL,                    // tgprpl_set_buddy_icon
   NULL,                    // remove_group
@@ -912,6 +959,12 @@ static void tgprpl_init (PurplePlugin *plugin) {
                                        TGP_DEFAULT_HISTORY_RETRIEVAL_THRESHOLD);
   prpl_info.protocol_options = g_list_append (prpl_info.protocol_options, opt);
   
+  opt = purple_account_option_int_new ("Limit downloads to (KiB/s)\n"
+                                       "(0 for unlimited)",
+                                       TGP_KEY_DOWNLOAD_RATE_LIMIT,
+                                       TGP_DEFAULT_DOWNLOAD_RATE_LIMIT);
+  prpl_info.protocol_options = g_list_append (prpl_info.protocol_options, opt);
+  
   // Chats
 
   opt = purple_account_option_bool_new ("Add group chats to buddy list",
@@ -935,8 +988,37 @@ static void tgprpl_init (PurplePlugin *plugin) {
   _telegram_protocol = plugin;
 }
 
+static void tgprpl_action_show_xfers (PurplePluginAction *action) {
+  PurpleConnection *gc = action->context;
+  connection_data *conn = purple_connection_get_protocol_data (gc);
+  
+  char *text = tgprpl_xfer_format_active (conn);
+  purple_notify_formatted (gc, "Active transfers", "Active transfers",
+                           purple_account_get_username (conn->pa), text, NULL, NULL);
+  g_free (text);
+}
+
+static void tgprpl_action_show_images (PurplePluginAction *action) {
+  PurpleConnection *gc = action->context;
+  connection_data *conn = purple_connection_get_protocol_data (gc);
+  
+  char *resident = tgp_g_format_size (tgp_imgstore_get_resident_bytes (conn));
+  char *saved = tgp_g_format_size (tgp_imgstore_get_saved_bytes (conn));
+  char *text = g_strdup_printf ("Images held in memory: %s\nSaved by reusing identical images: %s",
+                                resident, saved);
+  purple_notify_info (gc, "Image memory", purple_account_get_username (conn->pa), text);
+  g_free (text);
+  g_free (saved);
+  g_free (resident);
+}
+
 static GList *tgprpl_actions (PurplePlugin * plugin, gpointer context) {
-  return (GList *)NULL;
+  GList *actions = NULL;
+  actions = g_list_append (actions, purple_plugin_action_new ("Show active transfers...",
+                                                              tgprpl_action_show_xfers));
+  actions = g_list_append (actions, purple_plugin_action_new ("Show image memory usage...",
+                                                              tgprpl_action_show_images));
+  return actions;
 }
 
 static PurplePluginInfo plugin_info = {
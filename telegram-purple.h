@@ -39,6 +39,18 @@
 #define TGP_MAX_MSG_SIZE 4096
 #define TGP_DEFAULT_MAX_MSG_SPLIT_COUNT 4
 
+#define TGP_XFER_MAX_RETRIES 3
+#define TGP_XFER_RETRY_DELAY 10
+#define TGP_XFER_COPY_CHUNK 65536
+
+#define TGP_LOADER_MAX_RUNNING 2
+#define TGP_LOADER_RATE_BURST 5
+
+#define TGP_IMGSTORE_MAX_BYTES (16 * 1024 * 1024)
+
+#define TGP_DEFAULT_DOWNLOAD_RATE_LIMIT 0
+#define TGP_KEY_DOWNLOAD_RATE_LIMIT "download-rate-limit"
+
 #define TGP_KEY_PASSWORD_TWO_FACTOR "password-two-factor"
 
 #define TGP_DEFAULT_ACCEPT_SECRET_CHATS "ask"
@@ -59,6 +71,8 @@
 #define TGP_DEFAULT_DISPLAY_READ_NOTIFICATIONS FALSE
 #define TGP_KEY_DISPLAY_READ_NOTIFICATIONS "display-read-notifications"
 
+#define TGP_PENDING_READS_DELAY 2
+
 #define TGP_DEFAULT_SEND_READ_NOTIFICATIONS TRUE
 #define TGP_KEY_SEND_READ_NOTIFICATIONS "send-read-notifications"
 
@@ -22,17 +22,13 @@
 #include "config.h"
 #endif
 
-#ifdef HAVE_LIBWEBP
-#include <webp/decode.h>
-#include "lodepng/lodepng.h"
-#endif
-
 #include "telegram-purple.h"
 #include "tgp-2prpl.h"
 #include "tgp-structs.h"
 #include "telegram-purple.h"
 #include "tgp-utils.h"
 #include "telegram-base.h"
+#include "tgp-imgstore.h"
 
 #include <server.h>
 #include <tgl.h>
@@ -276,7 +272,7 @@ void p2tgl_prpl_got_user_status (struct tgl_state *TLS, tgl_peer_id_t user, stru
     p2tgl_prpl_got_set_status_online (TLS, user);
   } else {
     debug ("%d: when=%d", user.id, status->when);
-    if (tgp_time_n_days_ago (purple_account_get_int (data->pa, "inactive-days-offline", TGP_DEFAULT_INACTIVE_DAYS_OFFLINE)) > status->when && status->when) {
+    if (tgp_time_n_days_ago (data->settings.inactive_days_offline) > status->when && status->when) {
       debug ("offline");
       p2tgl_prpl_got_set_status_offline (TLS, user);
     }
@@ -458,78 +454,10 @@ PurpleNotifyUserInfo *p2tgl_notify_peer_info_new (struct tgl_state *TLS, tgl_pee
   }
 }
 
-int p2tgl_imgstore_add_with_id (const char* filename) {
-  gchar *data = NULL;
-  size_t len;
-  GError *err = NULL;
-  g_file_get_contents (filename, &data, &len, &err);
-  
-  int id = purple_imgstore_add_with_id (data, len, NULL);
-  return id;
-}
-
-#ifdef HAVE_LIBWEBP
-int p2tgl_imgstore_add_with_id_webp (const char *filename) {
-  
-  const uint8_t *data = NULL;
-  size_t len;
-  GError *err = NULL;
-  g_file_get_contents (filename, (gchar **) &data, &len, &err);
-  if (err) { warning ("cannot open file %s: %s.", filename, err->message); return 0; }
-  
-  // downscale oversized sticker images displayed in chat, otherwise it would harm readabillity
-  WebPDecoderConfig config;
-  WebPInitDecoderConfig (&config);
-  if (! WebPGetFeatures(data, len, &config.input) == VP8_STATUS_OK) {
-    warning ("error reading webp bitstream: %s", filename);
-    g_free ((gchar *)data);
-    return 0;
-  }
-  int H = config.input.height;
-  int W = config.input.width;
-  while (H > 256 || W > 256) {
-    H /= 2;
-    W /= 2;
-  }
-  config.options.use_scaling = 1;
-  config.options.scaled_width = W;
-  config.options.scaled_height = H;
-  config.output.colorspace = MODE_RGBA;
-  if (! WebPDecode(data, len, &config) == VP8_STATUS_OK) {
-    warning ("error decoding webp: %s", filename);
-    g_free ((gchar *)data);
-    return 0;
-  }
-  g_free ((gchar *)data);
-  const uint8_t *decoded = config.output.u.RGBA.rgba;
-
-  // convert to png
-  unsigned char* png = NULL;
-  size_t pnglen;
-  unsigned error = lodepng_encode32 (&png, &pnglen, decoded, config.options.scaled_width, config.options.scaled_height);
-  WebPFreeDecBuffer (&config.output);
-  if (error) {
-    warning ("error encoding webp as png: %s", filename);
-    return 0;
-  }
-  
-  // will be owned by libpurple imgstore, which uses glib functions for managing memory
-  void *pngdub = g_memdup (png, (guint)pnglen);
-  free (png);
-  
-  int imgStoreId = purple_imgstore_add_with_id (pngdub, pnglen, NULL);
-  return imgStoreId;
-}
-#endif
-
-void p2tgl_buddy_icons_set_for_user (PurpleAccount *pa, tgl_peer_id_t *id, const char* filename) {
+void p2tgl_buddy_icons_set_for_user (PurpleAccount *pa, tgl_peer_id_t *id, gchar *data, gsize len) {
   char *who = g_strdup_printf("%d", tgl_get_peer_id(*id));
-
-  gchar *data = NULL;
-  size_t len;
-  GError *err = NULL;
-  g_file_get_contents (filename, &data, &len, &err);
   
+  // takes ownership of the data
   purple_buddy_icons_set_for_user (pa, who, data, len, NULL);
   
   g_free (who);
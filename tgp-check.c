@@ -0,0 +1,334 @@
+/*
+ This file is part of telegram-purple
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+
+ Copyright Matthias Jentsch 2014-2015
+ */
+
+/*
+  Standalone checks for the helpers in tgp-utils that don't need a running libpurple or
+  libtgl. Built and run with 'make check', 'make bench' runs the benchmarks instead.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "tgp-utils.h"
+
+#include <purple.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TGP_BENCH_USEC 500000
+#define TGP_BENCH_CHUNK 4096
+#define TGP_BENCH_TEXT_SIZE (2 * 1024 * 1024)
+
+static int checks;
+static int failures;
+
+static void tgp_check_str (const char *what, const char *got, const char *expected) {
+  ++ checks;
+  if (strcmp (got, expected)) {
+    ++ failures;
+    printf ("FAIL %s\n  expected: \"%s\"\n       got: \"%s\"\n", what, expected, got);
+  }
+}
+
+static void tgp_check_int (const char *what, long got, long expected) {
+  ++ checks;
+  if (got != expected) {
+    ++ failures;
+    printf ("FAIL %s\n  expected: %ld\n       got: %ld\n", what, expected, got);
+  }
+}
+
+/*
+  Split text into chunks of max characters and join them with '|', also checking that no
+  chunk exceeds the limit and that the chunks add up to the original text
+ */
+static char *tgp_check_split (const char *text, int max) {
+  GString *joined = g_string_new ("");
+  GString *whole = g_string_new ("");
+  struct tgp_utf8_splitter S;
+  const char *chunk;
+  int len;
+
+  tgp_utf8_splitter_init (&S, text, max);
+  while ((len = tgp_utf8_splitter_next (&S, &chunk)) > 0) {
+    if (joined->len) {
+      g_string_append_c (joined, '|');
+    }
+    g_string_append_len (joined, chunk, len);
+    g_string_append_len (whole, chunk, len);
+    tgp_check_int ("chunk within limit", g_utf8_strlen (chunk, len) <= max, 1);
+  }
+  tgp_check_str ("chunks add up to the text", whole->str, text);
+  g_string_free (whole, TRUE);
+  return g_string_free (joined, FALSE);
+}
+
+static void tgp_check_splitter (void) {
+  struct {
+    const char *text;
+    int max;
+    const char *expected;
+  } cases[] = {
+    { "", 10, "" },
+    { "short", 10, "short" },
+    { "exactly10!", 10, "exactly10!" },
+    { "one two three four", 10, "one two |three four" },
+    { "first\n\nsecond para", 14, "first\n\n|second para" },
+    { "line one\nline two", 12, "line one\n|line two" },
+    { "abcdefghijklmnop", 5, "abcde|fghij|klmno|p" },
+
+    // a combining accent stays with its letter, even at the limit
+    { "abcde\xcc\x81" "fg", 5, "abcd|e\xcc\x81" "fg" },
+
+    // multi-byte characters count once
+    { "\xc3\xa4\xc3\xb6\xc3\xbc\xc3\xa4\xc3\xb6\xc3\xbc", 3, "\xc3\xa4\xc3\xb6\xc3\xbc|\xc3\xa4\xc3\xb6\xc3\xbc" },
+
+    // emoji joined with ZWJ and skin tone modifiers are never torn apart
+    { "ab\xf0\x9f\x91\xa9\xe2\x80\x8d\xf0\x9f\x92\xbb" "cd", 3, "ab|\xf0\x9f\x91\xa9\xe2\x80\x8d\xf0\x9f\x92\xbb|cd" },
+    { "abc\xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd", 4, "abc|\xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd" }
+  };
+  unsigned i;
+  for (i = 0; i < G_N_ELEMENTS (cases); i ++) {
+    char *got = tgp_check_split (cases[i].text, cases[i].max);
+    char *what = g_strdup_printf ("tgp_utf8_splitter case %u", i);
+    tgp_check_str (what, got, cases[i].expected);
+    g_free (what);
+    g_free (got);
+  }
+
+  // a long text is cut in linear time and still adds up
+  GString *big = g_string_new ("");
+  for (i = 0; i < 100000; i ++) {
+    g_string_append (big, i % 7 ? "word " : "line\n");
+  }
+  g_free (tgp_check_split (big->str, 4096));
+  g_string_free (big, TRUE);
+}
+
+static void tgp_check_html_to_text (void) {
+  struct {
+    const char *html;
+    const char *expected;
+  } cases[] = {
+    { "", "" },
+    { "plain text", "plain text" },
+    { "a &amp; b &lt;c&gt; &quot;d&quot;", "a & b <c> \"d\"" },
+    { "a < b", "a < b" },
+    { "one<br>two<BR/>three", "one\ntwo\nthree" },
+    { "<p>one</p><div>two</div>", "one\ntwo\n" },
+    { "<table><tr><td>a<td>b</tr></table>", "a\tb\n" },
+    { "<b>bold</b> <i>italic</i>", "bold italic" },
+    { "x<script>if (a<b) {}</script>y<style>p {}</style>z", "xyz" },
+
+    // link targets are kept, unless they are already the visible text
+    { "<a href=\"http://x.org/\">site</a>", "site (http://x.org/)" },
+    { "<a href=\"http://x.org/\">http://x.org/</a>", "http://x.org/" },
+    { "<a href='mailto:me@x.org'>me@x.org</a>", "me@x.org" },
+    { "<a href=http://x.org/>x</a>", "x (http://x.org/)" },
+
+    // the target is decoded like the text
+    { "<a href=\"http://x.org/?a=1&amp;b=2\">site</a>", "site (http://x.org/?a=1&b=2)" },
+    { "<a href=\"http://x.org/?a=1&amp;b=2\">http://x.org/?a=1&amp;b=2</a>", "http://x.org/?a=1&b=2" },
+
+    // quoted attribute values may contain '>' and look like other attributes
+    { "<a title=\"a > b\" href=\"http://y/\">y</a>", "y (http://y/)" },
+    { "<img alt='>' src=x>text", "text" },
+    { "<a title=\"href=bad\" href=good>t</a>", "t (good)" },
+    { "<a download href = \"z\">t</a>", "t (z)" }
+  };
+  unsigned i;
+  for (i = 0; i < G_N_ELEMENTS (cases); i ++) {
+    char *got = tgp_markup_html_to_text (cases[i].html);
+    char *what = g_strdup_printf ("tgp_markup_html_to_text (\"%s\")", cases[i].html);
+    tgp_check_str (what, got, cases[i].expected);
+    g_free (what);
+    g_free (got);
+  }
+}
+
+static void tgp_check_msg_dedup (void) {
+  struct tgp_msg_dedup D;
+  tgl_peer_id_t user = TGL_MK_USER (1), other_user = TGL_MK_USER (2), chat = TGL_MK_CHAT (1);
+
+  tgp_msg_dedup_init (&D);
+  tgp_check_int ("first message is new", tgp_msg_dedup_seen (&D, user, 10), 0);
+  tgp_check_int ("same message again", tgp_msg_dedup_seen (&D, user, 10), 1);
+
+  // message ids are only unique per peer
+  tgp_check_int ("same id from another user", tgp_msg_dedup_seen (&D, other_user, 10), 0);
+  tgp_check_int ("same id in a chat with the same number", tgp_msg_dedup_seen (&D, chat, 10), 0);
+  tgp_check_int ("same id from another user again", tgp_msg_dedup_seen (&D, other_user, 10), 1);
+
+  // ids below the high-water mark are new until they were seen
+  tgp_check_int ("older message is new", tgp_msg_dedup_seen (&D, user, 5), 0);
+  tgp_check_int ("older message again", tgp_msg_dedup_seen (&D, user, 5), 1);
+  tgp_check_int ("newer message is new", tgp_msg_dedup_seen (&D, user, 11), 0);
+  tgp_check_int ("duplicates counted", D.duplicates, 3);
+  tgp_msg_dedup_free (&D);
+}
+
+typedef void (*tgp_bench_func) (const char *text);
+
+/*
+  Run func on the text until at least TGP_BENCH_USEC passed and print the throughput
+ */
+static void tgp_bench_run (const char *what, tgp_bench_func func, const char *text) {
+  gsize len = strlen (text);
+  gint64 start = g_get_monotonic_time (), elapsed;
+  int runs = 0;
+  do {
+    func (text);
+    ++ runs;
+    elapsed = g_get_monotonic_time () - start;
+  } while (elapsed < TGP_BENCH_USEC);
+  printf ("  %-48s %9.1f MB/s\n", what, (double) len * runs / elapsed);
+}
+
+/*
+  Build a text of about TGP_BENCH_TEXT_SIZE bytes from words made of the given characters, with
+  line breaks and paragraphs in between
+ */
+static char *tgp_bench_text (const char **chars, int num_chars) {
+  GString *text = g_string_sized_new (TGP_BENCH_TEXT_SIZE + 64);
+  guint32 seed = 1;
+  while (text->len < TGP_BENCH_TEXT_SIZE) {
+    int len = 1 + (seed >> 16) % 9, i;
+    for (i = 0; i < len; i ++) {
+      seed = seed * 1103515245 + 12345;
+      g_string_append (text, chars[(seed >> 16) % num_chars]);
+    }
+    seed = seed * 1103515245 + 12345;
+    g_string_append (text, (seed >> 16) % 97 == 0 ? "\n\n" : ((seed >> 16) % 13 == 0 ? "\n" : " "));
+  }
+  return g_string_free (text, FALSE);
+}
+
+/*
+  How messages were split before: count all characters, then copy every chunk out of the text
+  starting from its beginning, which is quadratic in the length of the text
+ */
+static void tgp_bench_split_substring (const char *text) {
+  long size = g_utf8_strlen (text, -1), start;
+  for (start = 0; start < size; start += TGP_BENCH_CHUNK) {
+    g_free (g_utf8_substring (text, start, start + TGP_BENCH_CHUNK));
+  }
+}
+
+static void tgp_bench_split_stream (const char *text) {
+  struct tgp_utf8_splitter S;
+  const char *chunk;
+  tgp_utf8_splitter_init (&S, text, TGP_BENCH_CHUNK);
+  while (tgp_utf8_splitter_next (&S, &chunk) > 0) {}
+}
+
+static void tgp_bench_splitter (void) {
+  static const char *latin[] = { "a", "e", "i", "o", "n", "s", "t", "r", "l", "d", "h", "u", "c", "m" };
+  static const char *cyrillic[] = { "\xd0\xb0", "\xd0\xb5", "\xd0\xb8", "\xd0\xbe", "\xd0\xbd",
+                                    "\xd1\x81", "\xd1\x82", "\xd1\x80", "\xd0\xbb", "\xd0\xb4" };
+  static const char *emoji[] = { "a", "b", "\xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd",
+                                 "\xf0\x9f\x91\xa9\xe2\x80\x8d\xf0\x9f\x92\xbb", "e\xcc\x81" };
+  struct {
+    const char *name;
+    const char **chars;
+    int num;
+  } texts[] = {
+    { "latin", latin, G_N_ELEMENTS (latin) },
+    { "cyrillic", cyrillic, G_N_ELEMENTS (cyrillic) },
+    { "emoji and combining marks", emoji, G_N_ELEMENTS (emoji) }
+  };
+  unsigned i;
+  
+  printf ("Splitting %d MiB of text into %d character chunks:\n", TGP_BENCH_TEXT_SIZE >> 20, TGP_BENCH_CHUNK);
+  for (i = 0; i < G_N_ELEMENTS (texts); i ++) {
+    char *text = tgp_bench_text (texts[i].chars, texts[i].num);
+    char *what = g_strdup_printf ("%s, g_utf8_substring", texts[i].name);
+    tgp_bench_run (what, tgp_bench_split_substring, text);
+    g_free (what);
+    what = g_strdup_printf ("%s, tgp_utf8_splitter", texts[i].name);
+    tgp_bench_run (what, tgp_bench_split_stream, text);
+    g_free (what);
+    g_free (text);
+  }
+}
+
+/*
+  How messages were converted before: strip the markup, then unescape the entities in a second
+  pass, and escape incoming text after copying it
+ */
+static void tgp_bench_html_to_text_purple (const char *html) {
+  char *stripped = purple_markup_strip_html (html);
+  g_free (purple_unescape_text (stripped));
+  g_free (stripped);
+}
+
+static void tgp_bench_html_to_text (const char *html) {
+  g_free (tgp_markup_html_to_text (html));
+}
+
+static void tgp_bench_text_to_html_purple (const char *text) {
+  char *copy = g_strdup (text);
+  g_free (purple_markup_escape_text (copy, strlen (copy)));
+  g_free (copy);
+}
+
+static void tgp_bench_text_to_html (const char *text) {
+  g_free (tgp_markup_text_to_html (text, (int) strlen (text)));
+}
+
+static void tgp_bench_markup (void) {
+  static const char *lines[] = {
+    "<font color=\"#333333\">Hello <b>there</b>, how are you?</font><br>",
+    "Tom &amp; Jerry &lt;3 &quot;quotes&quot; and <i>more</i><br>",
+    "<a href=\"https://example.org/path?a=1&amp;b=2\">the link</a> to read<br>",
+    "<span style=\"direction:rtl;text-align:right;\">\xd7\xa9\xd7\x9c\xd7\x95\xd7\x9d</span><br>",
+    "plain text without any markup at all, just words and spaces<br>"
+  };
+  GString *html = g_string_sized_new (TGP_BENCH_TEXT_SIZE + 128);
+  unsigned i;
+  for (i = 0; html->len < TGP_BENCH_TEXT_SIZE; i ++) {
+    g_string_append (html, lines[i % G_N_ELEMENTS (lines)]);
+  }
+  char *text = tgp_markup_html_to_text (html->str);
+  
+  printf ("Converting %d MiB of markup and text:\n", TGP_BENCH_TEXT_SIZE >> 20);
+  tgp_bench_run ("html to text, strip_html + unescape_text", tgp_bench_html_to_text_purple, html->str);
+  tgp_bench_run ("html to text, tgp_markup_html_to_text", tgp_bench_html_to_text, html->str);
+  tgp_bench_run ("text to html, strdup + markup_escape_text", tgp_bench_text_to_html_purple, text);
+  tgp_bench_run ("text to html, tgp_markup_text_to_html", tgp_bench_text_to_html, text);
+  g_free (text);
+  g_string_free (html, TRUE);
+}
+
+int main (int argc, char **argv) {
+  if (argc > 1 && ! strcmp (argv[1], "--bench")) {
+    tgp_bench_splitter ();
+    tgp_bench_markup ();
+    return 0;
+  }
+  
+  tgp_check_splitter ();
+  tgp_check_html_to_text ();
+  tgp_check_msg_dedup ();
+
+  printf ("%d checks, %d failures\n", checks, failures);
+  return failures ? 1 : 0;
+}
@@ -21,11 +21,14 @@
 #include "tgp-utils.h"
 #include "tgp-ft.h"
 #include "tgp-structs.h"
+#include "tgp-loader.h"
+#include "tgp-upload.h"
 #include "msglog.h"
 
 #include <purple.h>
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <errno.h>
 #include "telegram-purple.h"
 #include "telegram-base.h"
 
@@ -65,33 +68,270 @@ static char *tgp_strdup_determine_filename (const char *mime, const char *captio
   return g_strdup_printf ("%lld.%s", ABS(hash), type);
 }
 
-static void tgprpl_xfer_recv_on_finished (struct tgl_state *TLS, void *_data, int success, const char *filename) {
-  debug ("tgprpl_xfer_recv_on_finished()");
-  struct tgp_xfer_send_data *data = _data;
+static void tgprpl_xfer_recv_on_finished (struct tgl_state *TLS, void *_data, int success, const char *filename);
+static void tgprpl_xfer_on_finished (struct tgl_state *TLS, void *_data, int success, struct tgl_message *M);
 
-  if (success) {
-    if (!data->done) {
-      debug ("purple_xfer_set_completed");
-      purple_xfer_set_bytes_sent (data->xfer, purple_xfer_get_size (data->xfer));
-      purple_xfer_set_completed (data->xfer, TRUE);
-      purple_xfer_end (data->xfer);
-    }
+static void tgprpl_xfer_recv_start (struct tgp_xfer_send_data *data) {
+  struct tgl_state *TLS = data->conn->TLS;
+  struct tgl_message *M = data->msg;
+  struct tgl_document *D = M->media.document;
+  
+  switch (M->media.type) {
+    case tgl_message_media_document:
+      tgp_loader_load_document (TLS, D, TGP_LOADER_INTERACTIVE, tgprpl_xfer_recv_on_finished, data);
+      break;
+      
+    case tgl_message_media_document_encr:
+      tgp_loader_load_encr_document (TLS, M->media.encr_document, TGP_LOADER_INTERACTIVE,
+                                     tgprpl_xfer_recv_on_finished, data);
+      break;
     
-    g_unlink (purple_xfer_get_local_filename (data->xfer));
-    g_rename (filename, purple_xfer_get_local_filename (data->xfer));
+    case tgl_message_media_audio:
+      tgp_loader_load_audio (TLS, D, TGP_LOADER_INTERACTIVE, tgprpl_xfer_recv_on_finished, data);
+      break;
+      
+    case tgl_message_media_video:
+      tgp_loader_load_video (TLS, D, TGP_LOADER_INTERACTIVE, tgprpl_xfer_recv_on_finished, data);
+      break;
 
+    default:
+      failure ("Unknown message media type: %d, XFER not possible.", M->media.type);
+      return;
+  }
+  data->loading = 1;
+}
+
+static void tgprpl_xfer_send_start (struct tgp_xfer_send_data *data) {
+  const char *localfile = purple_xfer_get_local_filename (data->xfer);
+  const char *who = purple_xfer_get_remote_user (data->xfer);
+  
+  tgl_peer_t *P = find_peer_by_name (data->conn->TLS, who);
+  if (P) {
+    data->upload = tgp_upload_document (data->conn->TLS, P->id, localfile, NULL,
+                                        TGL_SEND_MSG_FLAG_DOCUMENT_AUTO, tgprpl_xfer_on_finished, data);
+    data->loading = 1;
+  }
+}
+
+static gboolean tgprpl_xfer_retry_cb (gpointer _data) {
+  struct tgp_xfer_send_data *data = _data;
+  data->retry_timer = 0;
+  
+  debug ("restarting xfer, attempt %d", data->retries + 1);
+  data->bytes = 0;
+  purple_xfer_set_bytes_sent (data->xfer, 0);
+  purple_xfer_update_progress (data->xfer);
+  if (purple_xfer_get_type (data->xfer) == PURPLE_XFER_SEND) {
+    tgprpl_xfer_send_start (data);
   } else {
-    tgp_notify_on_error_gw (TLS, NULL, success);
-    failure ("ERROR xfer failed");
+    tgprpl_xfer_recv_start (data);
+  }
+  return FALSE;
+}
+
+/*
+  Whether the error of the last failed query may go away by itself: network errors and
+  timeouts, and errors the server reports as temporary (flood waits and internal errors).
+  libtgl reports all errors returned by the server as EPROTO with the code in the message.
+ */
+static int tgprpl_xfer_error_is_temporary (struct tgl_state *TLS) {
+  int code;
+  switch (TLS->error_code) {
+    case ETIMEDOUT:
+    case ECONNRESET:
+    case ECONNREFUSED:
+    case ECONNABORTED:
+    case ENETDOWN:
+    case ENETUNREACH:
+    case ENETRESET:
+    case EHOSTUNREACH:
+    case EAGAIN:
+      return TRUE;
+    case EPROTO:
+      return TLS->error && sscanf (TLS->error, "RPC_CALL_FAIL %d", &code) == 1 && (code == 420 || code >= 500);
+    default:
+      return FALSE;
+  }
+}
+
+/*
+  libtgl can only load files as a whole, so transfers that failed for a temporary reason are
+  restarted from the beginning after giving the connection some time to recover, all other
+  errors fail the transfer right away. Returns whether a retry was scheduled.
+ */
+static int tgprpl_xfer_retry (struct tgp_xfer_send_data *data) {
+  data->loading = 0;
+  if (data->retries >= TGP_XFER_MAX_RETRIES) {
+    return FALSE;
   }
+  if (! tgprpl_xfer_error_is_temporary (data->conn->TLS)) {
+    warning ("xfer failed permanently (%d: %s), not retrying", data->conn->TLS->error_code,
+             data->conn->TLS->error ? data->conn->TLS->error : "unknown error");
+    return FALSE;
+  }
+  ++ data->retries;
+  warning ("xfer failed, retrying in %d seconds", TGP_XFER_RETRY_DELAY);
+  data->retry_timer = purple_timeout_add_seconds (TGP_XFER_RETRY_DELAY, tgprpl_xfer_retry_cb, data);
+  return TRUE;
+}
 
+static void tgprpl_xfer_recv_completed (struct tgp_xfer_send_data *data) {
+  data->loading = 0;
+  if (!data->done) {
+    debug ("purple_xfer_set_completed");
+    purple_xfer_set_bytes_sent (data->xfer, purple_xfer_get_size (data->xfer));
+    purple_xfer_set_completed (data->xfer, TRUE);
+    purple_xfer_end (data->xfer);
+  }
   data->xfer->data = NULL;
   tgprpl_xfer_free_data (data);
 }
 
+static void tgprpl_xfer_recv_failed (struct tgp_xfer_send_data *data, const char *local, int err) {
+  char *msg = g_strdup_printf ("Cannot save %s: %s", local, g_strerror (err));
+  failure ("%s", msg);
+  purple_xfer_error (PURPLE_XFER_RECEIVE, data->conn->pa, purple_xfer_get_remote_user (data->xfer), msg);
+  g_free (msg);
+  
+  // the partially written file is removed when the data is freed
+  data->loading = 0;
+  purple_xfer_cancel_local (data->xfer);
+}
+
+static void tgprpl_xfer_copy_stop (struct tgp_xfer_send_data *data) {
+  if (data->copy_timer) {
+    purple_timeout_remove (data->copy_timer);
+    data->copy_timer = 0;
+  }
+  if (data->copy_in) {
+    fclose (data->copy_in);
+    data->copy_in = NULL;
+  }
+  if (data->copy_out) {
+    fclose (data->copy_out);
+    data->copy_out = NULL;
+    g_unlink (purple_xfer_get_local_filename (data->xfer));
+  }
+  if (data->copy_from) {
+    g_unlink (data->copy_from);
+    g_free (data->copy_from);
+    data->copy_from = NULL;
+  }
+}
+
+static gboolean tgprpl_xfer_copy_step (gpointer _data) {
+  struct tgp_xfer_send_data *data = _data;
+  char buf[TGP_XFER_COPY_CHUNK];
+  
+  size_t n = fread (buf, 1, sizeof (buf), data->copy_in);
+  if (n > 0 && fwrite (buf, 1, n, data->copy_out) != n) {
+    data->copy_timer = 0;
+    tgprpl_xfer_recv_failed (data, purple_xfer_get_local_filename (data->xfer), errno);
+    return FALSE;
+  }
+  if (n == sizeof (buf)) {
+    return TRUE;
+  }
+  
+  data->copy_timer = 0;
+  int failed = ferror (data->copy_in);
+  int err = errno;
+  fclose (data->copy_in);
+  data->copy_in = NULL;
+  if (fclose (data->copy_out) && ! failed) {
+    failed = TRUE;
+    err = errno;
+  }
+  data->copy_out = NULL;
+  
+  if (failed) {
+    g_unlink (purple_xfer_get_local_filename (data->xfer));
+    tgprpl_xfer_recv_failed (data, purple_xfer_get_local_filename (data->xfer), err);
+  } else {
+    tgprpl_xfer_recv_completed (data);
+  }
+  return FALSE;
+}
+
+/*
+  The download is on another file system or can't be cloned, copy the file in small steps from the
+  event loop so large files won't block the user interface
+ */
+static int tgprpl_xfer_copy_start (struct tgp_xfer_send_data *data, const char *from, const char *to) {
+  data->copy_in = g_fopen (from, "rb");
+  if (! data->copy_in) {
+    return FALSE;
+  }
+  data->copy_out = g_fopen (to, "wb");
+  if (! data->copy_out) {
+    int err = errno;
+    fclose (data->copy_in);
+    data->copy_in = NULL;
+    errno = err;
+    return FALSE;
+  }
+  data->loading = 0;
+  data->copy_timer = purple_timeout_add (0, tgprpl_xfer_copy_step, data);
+  return TRUE;
+}
+
+static void tgprpl_xfer_recv_on_finished (struct tgl_state *TLS, void *_data, int success, const char *filename) {
+  debug ("tgprpl_xfer_recv_on_finished()");
+  struct tgp_xfer_send_data *data = _data;
+  
+  if (data->canceled) {
+    tgprpl_xfer_free_data (data);
+    return;
+  }
+
+  if (! success) {
+    if (tgprpl_xfer_retry (data)) {
+      return;
+    }
+    tgp_notify_on_error_gw (TLS, NULL, success);
+    failure ("ERROR xfer failed");
+    data->xfer->data = NULL;
+    tgprpl_xfer_free_data (data);
+    return;
+  }
+  
+  // files loaded only for this transfer belong to it and are moved to the destination, which is
+  // cheap on the same file system. Files from the cache stay there, the user gets a copy of their
+  // own, since the cache is served without checking its content.
+  const char *local = purple_xfer_get_local_filename (data->xfer);
+  if (! tgp_loader_is_cached (data->conn, filename)) {
+    if (! g_rename (filename, local)) {
+      tgprpl_xfer_recv_completed (data);
+      return;
+    }
+    int err = errno;
+    if (err != EXDEV) {
+      g_unlink (filename);
+      tgprpl_xfer_recv_failed (data, local, err);
+      return;
+    }
+    
+    // the download is removed once the transfer is freed
+    data->copy_from = g_strdup (filename);
+  } else if (tgp_file_clone (filename, local)) {
+    tgprpl_xfer_recv_completed (data);
+    return;
+  }
+  debug ("cannot move or clone %s to %s (%s), copying instead", filename, local, g_strerror (errno));
+  if (! tgprpl_xfer_copy_start (data, filename, local)) {
+    tgprpl_xfer_recv_failed (data, local, errno);
+  }
+}
+
 static void tgprpl_xfer_on_finished (struct tgl_state *TLS, void *_data, int success, struct tgl_message *M) {
   debug ("tgprpl_xfer_on_finished()");
   struct tgp_xfer_send_data *data = _data;
+  data->upload = NULL;
+  
+  if (data->canceled) {
+    tgprpl_xfer_free_data (data);
+    return;
+  }
   
   if (success) {
     if (!data->done) {
@@ -102,6 +342,9 @@ static void tgprpl_xfer_on_finished (struct tgl_state *TLS, void *_data, int suc
     }
     write_secret_chat_file (TLS);
   } else {
+    if (tgprpl_xfer_retry (data)) {
+      return;
+    }
     tgp_notify_on_error_gw (TLS, NULL, success);
     failure ("ERROR xfer failed");
   }
@@ -112,87 +355,116 @@ static void tgprpl_xfer_on_finished (struct tgl_state *TLS, void *_data, int suc
 
 static void tgprpl_xfer_canceled (PurpleXfer *X) {
   struct tgp_xfer_send_data *data = X->data;
+  X->data = NULL;
+  
+  // copying the finished download can be aborted right away
+  tgprpl_xfer_copy_stop (data);
+  
+  // the loader drops the download if it is still queued and won't call back in any case
+  if (data->loading && purple_xfer_get_type (X) == PURPLE_XFER_RECEIVE) {
+    tgp_loader_cancel (data->conn, data);
+    data->loading = 0;
+  }
+  
+  // libtgl can't abort running uploads, the data is needed until the finished callback is called,
+  // but the PurpleXfer is freed right after this returns
+  if (data->loading) {
+    data->canceled = 1;
+    data->loading = 0;
+    data->xfer = NULL;
+    
+    // uploads that are still being hashed are aborted right away and free the data
+    if (data->upload) {
+      tgp_upload_cancel (data->upload);
+    }
+    return;
+  }
   tgprpl_xfer_free_data (data);
 }
 
-static gboolean tgprpl_xfer_upload_progress (gpointer _data) {
-  PurpleXfer *X = _data;
-  struct tgp_xfer_send_data *data = X->data;
-  connection_data *conn = data->conn;
+/*
+  Return the bytes libtgl transferred in one direction since the last call, libtgl takes finished
+  files off its counters, which is skipped
+ */
+static long long tgprpl_xfer_bytes_delta (long long *last, long long now) {
+  long long delta = now - *last;
+  *last = now;
+  return delta > 0 ? delta : 0;
+}
+
+/*
+  Pushes the progress to all running transfers, called by the network layer whenever answers
+  to queries arrived that may have completed a chunk. Downloads report the size of the file libtgl
+  is writing when it can be found. Otherwise, since libtgl only counts bytes for the whole account
+  and loads one part of each file at a time, the new bytes are split evenly between all loads
+  running in that direction and added to the count of each transfer, which is only completed by
+  its own finished callback. Transfers that are still queued by the loader or being hashed get
+  nothing.
+ */
+void tgprpl_xfer_update_progress (connection_data *conn) {
+  struct tgl_state *TLS = conn->TLS;
+  GList *xfers;
   
-  PurpleXferType type = purple_xfer_get_type(X);
-  switch (type) {
-    case PURPLE_XFER_SEND:
-      purple_xfer_set_size (X, conn->TLS->cur_uploading_bytes);
-      purple_xfer_set_bytes_sent (X, conn->TLS->cur_uploaded_bytes);
-      purple_xfer_update_progress (X);
-      
-      debug ("PURPLE_XFER_SEND progress %d / %d", conn->TLS->cur_uploaded_bytes, conn->TLS->cur_uploading_bytes);
-      if (conn->TLS->cur_uploaded_bytes == conn->TLS->cur_uploading_bytes) {
-        data->timer = 0;
-        return FALSE;
+  long long downloaded = tgprpl_xfer_bytes_delta (&conn->xfer_downloaded_bytes, TLS->cur_downloaded_bytes);
+  long long uploaded = tgprpl_xfer_bytes_delta (&conn->xfer_uploaded_bytes, TLS->cur_uploaded_bytes);
+  if (! downloaded && ! uploaded) {
+    return;
+  }
+  int downloads = conn->loads_running, uploads = tgp_upload_count_sending (conn);
+  
+  for (xfers = conn->xfers; xfers; xfers = g_list_next (xfers)) {
+    struct tgp_xfer_send_data *data = xfers->data;
+    if (! data->loading || data->done || data->canceled) {
+      continue;
+    }
+    
+    PurpleXfer *X = data->xfer;
+    switch (purple_xfer_get_type (X)) {
+      case PURPLE_XFER_SEND:
+        if (! uploads || ! data->upload || ! tgp_upload_is_sending (data->upload)) {
+          continue;
+        }
+        data->bytes += (double) uploaded / uploads;
+        break;
+      case PURPLE_XFER_RECEIVE: {
+        if (! downloads || ! tgp_loader_is_running (conn, data)) {
+          continue;
+        }
+        long long loaded = tgp_loader_get_loaded (conn, data);
+        if (loaded >= 0) {
+          data->bytes = loaded;
+        } else {
+          data->bytes += (double) downloaded / downloads;
+        }
+        break;
       }
-      break;
-      
-    case PURPLE_XFER_RECEIVE:
-      purple_xfer_set_size (X, conn->TLS->cur_downloading_bytes);
-      purple_xfer_set_bytes_sent (X, conn->TLS->cur_downloaded_bytes);
+      default:
+        continue;
+    }
+    
+    size_t size = purple_xfer_get_size (X);
+    size_t bytes = (size_t) data->bytes;
+    if (bytes >= size) {
+      bytes = size ? size - 1 : 0;
+    }
+    if (bytes > purple_xfer_get_bytes_sent (X)) {
+      purple_xfer_set_bytes_sent (X, bytes);
       purple_xfer_update_progress (X);
-      
-      debug ("PURPLE_XFER_RECEIVE progress %d / %d", conn->TLS->cur_downloaded_bytes, conn->TLS->cur_downloading_bytes);
-      if (conn->TLS->cur_downloading_bytes == conn->TLS->cur_downloaded_bytes) {
-        data->timer = 0;
-        return FALSE;
-      }
-      break;
-      
-    default:
-    case PURPLE_XFER_UNKNOWN:
-      failure ("ERROR: tgprpl_xfer_upload_progress xfer type PURPLE_XFER_UNKNOWN.");
-      return FALSE;
-      break;
+    }
   }
-  return TRUE;
 }
 
 static void tgprpl_xfer_recv_init (PurpleXfer *X) {
   debug ("tgprpl_xfer_recv_init");
   struct tgp_xfer_send_data *data = X->data;
-  struct tgl_state *TLS = data->conn->TLS;
-  struct tgl_message *M = data->msg;
-  struct tgl_document *D = M->media.document;
-  tgl_peer_t *P = NULL;
   
   purple_xfer_start (X, -1, NULL, 0);
   const char *who = purple_xfer_get_remote_user (X);
-  P = find_peer_by_name (TLS, who);
-  if (P) {
-    switch (M->media.type) {
-      case tgl_message_media_document:
-        tgl_do_load_document (TLS, D, tgprpl_xfer_recv_on_finished, data);
-        break;
-        
-      case tgl_message_media_document_encr:
-        tgl_do_load_encr_document (TLS, M->media.encr_document,
-                                   tgprpl_xfer_recv_on_finished, data);
-        break;
-      
-      case tgl_message_media_audio:
-        tgl_do_load_audio (TLS, D, tgprpl_xfer_recv_on_finished, data);
-        break;
-        
-      case tgl_message_media_video:
-        tgl_do_load_video (TLS, D, tgprpl_xfer_recv_on_finished, data);
-        break;
-
-      default:
-        failure ("Unknown message media type: %d, XFER not possible.", M->media.type);
-        break;
-    }
+  if (find_peer_by_name (data->conn->TLS, who)) {
+    tgprpl_xfer_recv_start (data);
   } else {
     warning ("User not found, not downloading...");
   }
-  data->timer = purple_timeout_add (100, tgprpl_xfer_upload_progress, X);
 }
 
 static void tgprpl_xfer_send_init (PurpleXfer *X) {
@@ -205,13 +477,7 @@ static void tgprpl_xfer_send_init (PurpleXfer *X) {
   const char *who = purple_xfer_get_remote_user (X);
   debug ("xfer_on_init (file=%s, local=%s, who=%s)", file, localfile, who);
   
-  tgl_peer_t *P = find_peer_by_name (data->conn->TLS, who);
-  if (P) {
-      tgl_do_send_document (data->conn->TLS, P->id, (char*) localfile, NULL,
-                            0, TGL_SEND_MSG_FLAG_DOCUMENT_AUTO, tgprpl_xfer_on_finished, data);
-  }
-  
-  data->timer = purple_timeout_add (100, tgprpl_xfer_upload_progress, X);
+  tgprpl_xfer_send_start (data);
 }
 
 static void tgprpl_xfer_init_data (PurpleXfer *X, connection_data *conn, struct tgl_message *msg) {
@@ -221,28 +487,94 @@ static void tgprpl_xfer_init_data (PurpleXfer *X, connection_data *conn, struct
     data->conn = conn;
     data->msg = msg;
     X->data = data;
+    conn->xfers = g_list_prepend (conn->xfers, data);
   }
 }
 
 static void tgprpl_xfer_free_data (struct tgp_xfer_send_data *data) {
-    if (data->timer) { purple_input_remove(data->timer); }
-    data->timer = 0;
+    if (data->retry_timer) { purple_timeout_remove (data->retry_timer); }
+    tgprpl_xfer_copy_stop (data);
+    data->conn->xfers = g_list_remove (data->conn->xfers, data);
     g_free (data);
 }
 
 void tgprpl_xfer_free_all (connection_data *conn) {
-  GList *xfers = purple_xfers_get_all();
-  while (xfers) {
-    PurpleXfer *xfer = xfers->data;
-    struct tgp_xfer_send_data *data = xfer->data;
+  while (conn->xfers) {
+    struct tgp_xfer_send_data *data = conn->xfers->data;
     
-    if (data) {
-      purple_xfer_cancel_local (xfer);
+    // libtgl is shut down afterwards and won't call back, running loads can be freed right away
+    data->loading = 0;
+    if (data->xfer && data->xfer->data == data) {
+      purple_xfer_cancel_local (data->xfer);
+    } else {
+      tgprpl_xfer_free_data (data);
     }
-    xfers = g_list_next(xfers);
   }
 }
 
+static const char *tgprpl_xfer_state (struct tgp_xfer_send_data *data) {
+  if (data->canceled) {
+    return "canceling";
+  }
+  if (data->retry_timer) {
+    return "waiting for retry";
+  }
+  if (data->copy_timer) {
+    return "saving";
+  }
+  if (data->upload && ! data->loading) {
+    return "preparing";
+  }
+  if (data->loading) {
+    return purple_xfer_get_type (data->xfer) == PURPLE_XFER_SEND ? "uploading" : "downloading";
+  }
+  return "waiting for user";
+}
+
+char *tgprpl_xfer_format_active (connection_data *conn) {
+  GString *str = g_string_new ("");
+  GList *xfers;
+  int num = 0;
+  
+  for (xfers = conn->xfers; xfers; xfers = g_list_next (xfers)) {
+    struct tgp_xfer_send_data *data = xfers->data;
+    PurpleXfer *X = data->xfer;
+    ++ num;
+    
+    // the PurpleXfer of a canceled transfer is already gone
+    if (! X) {
+      g_string_append_printf (str, "<b>Canceled transfer</b><br>%s<br><br>", tgprpl_xfer_state (data));
+      continue;
+    }
+    
+    char *sent = tgp_g_format_size (purple_xfer_get_bytes_sent (X));
+    char *size = tgp_g_format_size (purple_xfer_get_size (X));
+    char *name = g_markup_escape_text (purple_xfer_get_filename (X) ? purple_xfer_get_filename (X) : "", -1);
+    char *who = g_markup_escape_text (purple_xfer_get_remote_user (X), -1);
+    g_string_append_printf (str, "<b>%s</b> %s %s<br>%s of %s, %s", name,
+                            purple_xfer_get_type (X) == PURPLE_XFER_SEND ? "to" : "from",
+                            who, sent, size, tgprpl_xfer_state (data));
+    if (data->retries) {
+      g_string_append_printf (str, ", attempt %d of %d", data->retries + 1, TGP_XFER_MAX_RETRIES + 1);
+    }
+    g_string_append (str, "<br><br>");
+    g_free (who);
+    g_free (name);
+    g_free (size);
+    g_free (sent);
+  }
+  if (! num) {
+    g_string_append (str, "No active transfers.<br><br>");
+  }
+  
+  g_string_append_printf (str, "Media loads running: %d<br>Media loads queued: %d interactive, %d previews, "
+                          "%d background", conn->loads_running,
+                          g_queue_get_length (conn->load_queues[TGP_LOADER_INTERACTIVE]),
+                          g_queue_get_length (conn->load_queues[TGP_LOADER_PREVIEW]),
+                          g_queue_get_length (conn->load_queues[TGP_LOADER_BACKGROUND]));
+  return g_string_free (str, FALSE);
+}
+
 PurpleXfer *tgprpl_new_xfer (PurpleConnection * gc, const char *who) {
   debug ("tgprpl_new_xfer()");
   
@@ -31,5 +31,11 @@ void tgprpl_send_file (PurpleConnection * gc, const char *who, const char *file)
 void tgprpl_recv_file (PurpleConnection * gc, const char *who, struct tgl_message *M);
 void tgprpl_recv_encr_file (PurpleConnection * gc, const char *who, struct tgl_message *M);
 void tgprpl_xfer_free_all (connection_data *conn);
+void tgprpl_xfer_update_progress (connection_data *conn);
+
+/**
+ * Describe all transfers of this account, as HTML
+ */
+char *tgprpl_xfer_format_active (connection_data *conn);
 
 #endif
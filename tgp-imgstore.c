@@ -0,0 +1,420 @@
+/*
+ This file is part of telegram-purple
+ 
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ 
+ Copyright Matthias Jentsch 2014-2015
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "tgp-imgstore.h"
+#include "tgp-worker.h"
+#include "tgp-utils.h"
+#include "telegram-purple.h"
+#include "msglog.h"
+
+#include <purple.h>
+#include <glib.h>
+#include <string.h>
+
+#ifdef HAVE_LIBWEBP
+#include <webp/decode.h>
+#include "lodepng/lodepng.h"
+#endif
+
+struct tgp_imgstore_load_job {
+  connection_data *conn;
+  char *filename;
+  char *png_cache;
+  int webp;
+  gchar *data;
+  gsize len;
+  char *error;
+  tgp_imgstore_loaded_cb cb;
+  void *extra;
+  GDestroyNotify free_extra;
+};
+
+static void tgp_imgstore_load_job_free (gpointer data) {
+  struct tgp_imgstore_load_job *J = data;
+  
+  // the job was dropped, because the account was closed
+  if (J->extra && J->free_extra) {
+    J->free_extra (J->extra);
+  }
+  g_free (J->filename);
+  g_free (J->png_cache);
+  g_free (J->data);
+  g_free (J->error);
+  g_free (J);
+}
+
+static int tgp_imgstore_read (struct tgp_imgstore_load_job *J, const char *filename) {
+  GError *err = NULL;
+  if (! g_file_get_contents (filename, &J->data, &J->len, &err)) {
+    J->error = g_strdup_printf ("cannot open file %s: %s", filename, err->message);
+    g_error_free (err);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+#ifdef HAVE_LIBWEBP
+static void tgp_imgstore_convert_webp (struct tgp_imgstore_load_job *J);
+#endif
+
+/*
+  Runs on a worker thread, must not call any libpurple functions
+ */
+static void tgp_imgstore_load_work (gpointer data) {
+  struct tgp_imgstore_load_job *J = data;
+  
+#ifdef HAVE_LIBWEBP
+  if (J->webp) {
+    if (g_file_test (J->png_cache, G_FILE_TEST_IS_REGULAR) && tgp_imgstore_read (J, J->png_cache)) {
+      return;
+    }
+    g_free (J->error);
+    J->error = NULL;
+    tgp_imgstore_convert_webp (J);
+    return;
+  }
+#endif
+  tgp_imgstore_read (J, J->filename);
+}
+
+static void tgp_imgstore_load_done (gpointer data) {
+  struct tgp_imgstore_load_job *J = data;
+  if (J->error) {
+    warning ("%s", J->error);
+  }
+  
+  // ownership of the data and extra is passed to the callback
+  gchar *img = J->data;
+  void *extra = J->extra;
+  J->data = NULL;
+  J->extra = NULL;
+  J->cb (J->conn, extra, img, J->len);
+}
+
+static void tgp_imgstore_load_start (connection_data *conn, const char *filename, const char *png_cache,
+                                     tgp_imgstore_loaded_cb cb, void *extra, GDestroyNotify free_extra) {
+  struct tgp_imgstore_load_job *J = g_new0 (struct tgp_imgstore_load_job, 1);
+  J->conn = conn;
+  J->filename = g_strdup (filename);
+  J->png_cache = g_strdup (png_cache);
+  J->webp = png_cache != NULL;
+  J->cb = cb;
+  J->extra = extra;
+  J->free_extra = free_extra;
+  tgp_worker_run (conn, tgp_imgstore_load_work, tgp_imgstore_load_done, tgp_imgstore_load_job_free, J);
+}
+
+void tgp_imgstore_load (connection_data *conn, const char *filename, tgp_imgstore_loaded_cb cb, void *extra,
+                        GDestroyNotify free_extra) {
+  tgp_imgstore_load_start (conn, filename, NULL, cb, extra, free_extra);
+}
+
+#ifdef HAVE_LIBWEBP
+void tgp_imgstore_load_webp (connection_data *conn, const char *filename, const char *png_cache,
+                             tgp_imgstore_loaded_cb cb, void *extra, GDestroyNotify free_extra) {
+  tgp_imgstore_load_start (conn, filename, png_cache, cb, extra, free_extra);
+}
+
+static unsigned tgp_imgstore_png_write (const unsigned char *data, size_t size, void *context) {
+  g_byte_array_append (context, data, (guint) size);
+  return 0;
+}
+
+static void tgp_imgstore_convert_webp (struct tgp_imgstore_load_job *J) {
+  const char *filename = J->filename;
+  const uint8_t *data = NULL;
+  size_t len;
+  GError *err = NULL;
+  g_file_get_contents (filename, (gchar **) &data, &len, &err);
+  if (err) {
+    J->error = g_strdup_printf ("cannot open file %s: %s.", filename, err->message);
+    g_error_free (err);
+    return;
+  }
+  
+  // downscale oversized sticker images displayed in chat, otherwise it would harm readabillity
+  WebPDecoderConfig config;
+  WebPInitDecoderConfig (&config);
+  if (! WebPGetFeatures(data, len, &config.input) == VP8_STATUS_OK) {
+    J->error = g_strdup_printf ("error reading webp bitstream: %s", filename);
+    g_free ((gchar *)data);
+    return;
+  }
+  int H = config.input.height;
+  int W = config.input.width;
+  while (H > 256 || W > 256) {
+    H /= 2;
+    W /= 2;
+  }
+  config.options.use_scaling = 1;
+  config.options.scaled_width = W;
+  config.options.scaled_height = H;
+  config.output.colorspace = MODE_RGBA;
+  if (! WebPDecode(data, len, &config) == VP8_STATUS_OK) {
+    J->error = g_strdup_printf ("error decoding webp: %s", filename);
+    g_free ((gchar *)data);
+    return;
+  }
+  g_free ((gchar *)data);
+  const uint8_t *decoded = config.output.u.RGBA.rgba;
+  
+  // convert to png row by row straight into a glib buffer, only shown in the conversation so favour speed over size
+  GByteArray *png = g_byte_array_new ();
+  LodePNGState state;
+  LodePNGStreamEncoder encoder;
+  lodepng_state_init (&state);
+  lodepng_encoder_settings_fast (&state.encoder);
+  unsigned error = lodepng_stream_encoder_begin (&encoder, &state, W, H, tgp_imgstore_png_write, png);
+  int y;
+  for (y = 0; ! error && y < H; y ++) {
+    error = lodepng_stream_encoder_add_row (&encoder, decoded + y * config.output.u.RGBA.stride);
+  }
+  if (! error) {
+    error = lodepng_stream_encoder_finish (&encoder);
+  }
+  lodepng_stream_encoder_cleanup (&encoder);
+  lodepng_state_cleanup (&state);
+  WebPFreeDecBuffer (&config.output);
+  if (error) {
+    J->error = g_strdup_printf ("error encoding webp as png: %s", filename);
+    g_byte_array_free (png, TRUE);
+    return;
+  }
+  
+  GError *write_err = NULL;
+  if (! g_file_set_contents (J->png_cache, (gchar *) png->data, png->len, &write_err)) {
+    J->error = g_strdup_printf ("cannot store converted sticker %s: %s", J->png_cache, write_err->message);
+    g_error_free (write_err);
+  }
+  
+  // will be owned by libpurple imgstore, which uses glib functions for managing memory
+  J->len = png->len;
+  J->data = (gchar *) g_byte_array_free (png, FALSE);
+}
+#endif
+
+struct tgp_image {
+  int id;
+  gsize size;
+  int conversations;
+  
+  // link in the LRU queue, only for images that are not shown in any open conversation
+  GList *unused;
+};
+
+static void tgp_image_free (gpointer data) {
+  struct tgp_image *I = data;
+  purple_imgstore_unref_by_id (I->id);
+  g_free (I);
+}
+
+static void tgp_imgstore_init (connection_data *conn) {
+  if (conn->images) {
+    return;
+  }
+  conn->image_hashes = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+  conn->images = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, tgp_image_free);
+  conn->images_unused = g_queue_new ();
+  conn->conversation_images = g_hash_table_new_full (tgp_peer_id_hash, tgp_peer_id_equal, g_free,
+                                                      (GDestroyNotify) g_hash_table_destroy);
+}
+
+static void tgp_imgstore_release (connection_data *conn, struct tgp_image *I) {
+  debug ("releasing image %d (%" G_GSIZE_FORMAT " bytes)", I->id, I->size);
+  if (I->unused) {
+    g_queue_delete_link (conn->images_unused, I->unused);
+  }
+  conn->images_bytes -= I->size;
+  g_hash_table_remove (conn->images, GINT_TO_POINTER (I->id));
+}
+
+static void tgp_imgstore_evict (connection_data *conn) {
+  // the most recent image is always kept, its id may still be about to be displayed
+  while (conn->images_bytes > TGP_IMGSTORE_MAX_BYTES && g_queue_get_length (conn->images_unused) > 1) {
+    tgp_imgstore_release (conn, g_queue_peek_tail (conn->images_unused));
+  }
+}
+
+static void tgp_imgstore_set_unused (connection_data *conn, struct tgp_image *I) {
+  g_queue_push_head (conn->images_unused, I);
+  I->unused = g_queue_peek_head_link (conn->images_unused);
+}
+
+/*
+  Fast non-cryptographic 64 bit hash, processing 8 bytes per step. Collisions are harmless, since
+  matches are compared byte by byte before reusing an image.
+ */
+static guint64 tgp_imgstore_hash (const guchar *data, gsize len) {
+  const guint64 m = G_GUINT64_CONSTANT (0xc6a4a7935bd1e995);
+  guint64 h = G_GUINT64_CONSTANT (0x9e3779b97f4a7c15) ^ (len * m);
+  
+  gsize i;
+  for (i = 0; i + 8 <= len; i += 8) {
+    guint64 k;
+    memcpy (&k, data + i, 8);
+    k *= m;
+    k ^= k >> 47;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  for (; i < len; i ++) {
+    h ^= (guint64) data[i] << ((i & 7) * 8);
+  }
+  h *= m;
+  h ^= h >> 47;
+  h *= m;
+  h ^= h >> 47;
+  return h;
+}
+
+/*
+  The hash index is not updated when images are released, entries of images that are gone are
+  removed whenever the index grows larger than twice the number of managed images
+ */
+static void tgp_imgstore_prune_hashes (connection_data *conn) {
+  if (g_hash_table_size (conn->image_hashes) <= 2 * g_hash_table_size (conn->images) + 64) {
+    return;
+  }
+  GHashTableIter iter;
+  gpointer id;
+  g_hash_table_iter_init (&iter, conn->image_hashes);
+  while (g_hash_table_iter_next (&iter, NULL, &id)) {
+    if (! purple_imgstore_find_by_id (GPOINTER_TO_INT (id))) {
+      g_hash_table_iter_remove (&iter);
+    }
+  }
+}
+
+int tgp_imgstore_add_data (connection_data *conn, gpointer data, gsize len) {
+  tgp_imgstore_init (conn);
+  
+  guint64 hash = tgp_imgstore_hash (data, len);
+  int id = GPOINTER_TO_INT (g_hash_table_lookup (conn->image_hashes, &hash));
+  if (id) {
+    PurpleStoredImage *psi = purple_imgstore_find_by_id (id);
+    if (psi && purple_imgstore_get_size (psi) == len && ! memcmp (purple_imgstore_get_data (psi), data, len)) {
+      purple_imgstore_ref (psi);
+      conn->images_bytes_saved += len;
+      g_free (data);
+      return id;
+    }
+  }
+  
+  id = purple_imgstore_add_with_id (data, len, NULL);
+  if (id <= 0) {
+    // libpurple only takes ownership of data it stored
+    g_free (data);
+    return 0;
+  }
+  g_hash_table_replace (conn->image_hashes, g_memdup (&hash, sizeof (hash)), GINT_TO_POINTER (id));
+  tgp_imgstore_prune_hashes (conn);
+  return id;
+}
+
+void tgp_imgstore_add (connection_data *conn, int id, const tgl_peer_id_t *conversation) {
+  tgp_imgstore_init (conn);
+  
+  struct tgp_image *I = g_hash_table_lookup (conn->images, GINT_TO_POINTER (id));
+  if (I) {
+    // the manager already owns a reference to this image
+    purple_imgstore_unref_by_id (id);
+    if (I->unused) {
+      g_queue_delete_link (conn->images_unused, I->unused);
+      I->unused = NULL;
+    }
+  } else {
+    PurpleStoredImage *psi = purple_imgstore_find_by_id (id);
+    if (! psi) {
+      return;
+    }
+    I = g_new0 (struct tgp_image, 1);
+    I->id = id;
+    I->size = purple_imgstore_get_size (psi);
+    conn->images_bytes += I->size;
+    g_hash_table_insert (conn->images, GINT_TO_POINTER (id), I);
+  }
+  
+  if (conversation) {
+    GHashTable *shown = g_hash_table_lookup (conn->conversation_images, conversation);
+    if (! shown) {
+      shown = g_hash_table_new (g_direct_hash, g_direct_equal);
+      g_hash_table_insert (conn->conversation_images, g_memdup (conversation, sizeof (*conversation)), shown);
+    }
+    if (! g_hash_table_lookup (shown, GINT_TO_POINTER (id))) {
+      g_hash_table_insert (shown, GINT_TO_POINTER (id), GINT_TO_POINTER (TRUE));
+      ++ I->conversations;
+    }
+  }
+  
+  if (! I->conversations) {
+    tgp_imgstore_set_unused (conn, I);
+  }
+  tgp_imgstore_evict (conn);
+}
+
+void tgp_imgstore_conversation_closed (connection_data *conn, tgl_peer_id_t conversation) {
+  if (! conn->conversation_images) {
+    return;
+  }
+  GHashTable *shown = g_hash_table_lookup (conn->conversation_images, &conversation);
+  if (! shown) {
+    return;
+  }
+  
+  GHashTableIter iter;
+  gpointer id;
+  g_hash_table_iter_init (&iter, shown);
+  while (g_hash_table_iter_next (&iter, &id, NULL)) {
+    struct tgp_image *I = g_hash_table_lookup (conn->images, id);
+    if (I && -- I->conversations == 0) {
+      tgp_imgstore_set_unused (conn, I);
+    }
+  }
+  g_hash_table_remove (conn->conversation_images, &conversation);
+  tgp_imgstore_evict (conn);
+}
+
+gsize tgp_imgstore_get_resident_bytes (connection_data *conn) {
+  return conn->images_bytes;
+}
+
+gsize tgp_imgstore_get_saved_bytes (connection_data *conn) {
+  return conn->images_bytes_saved;
+}
+
+void tgp_imgstore_free_all (connection_data *conn) {
+  if (! conn->images) {
+    return;
+  }
+  g_hash_table_destroy (conn->conversation_images);
+  g_queue_free (conn->images_unused);
+  g_hash_table_destroy (conn->images);
+  g_hash_table_destroy (conn->image_hashes);
+  conn->image_hashes = NULL;
+  conn->conversation_images = NULL;
+  conn->images_unused = NULL;
+  conn->images = NULL;
+  conn->images_bytes = 0;
+}
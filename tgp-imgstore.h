@@ -0,0 +1,82 @@
+/*
+ This file is part of telegram-purple
+ 
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ 
+ Copyright Matthias Jentsch 2014-2015
+ */
+
+#ifndef __telegram_adium__tgp_imgstore__
+#define __telegram_adium__tgp_imgstore__
+
+#include "tgp-structs.h"
+
+typedef void (*tgp_imgstore_loaded_cb) (connection_data *conn, void *extra, gchar *data, gsize len);
+
+/**
+ * Read an image file on a worker thread, the callback receives the contents or NULL on errors and
+ * takes ownership of them
+ *
+ * When the account is closed before the callback was called, extra is passed to free_extra
+ * instead, if given.
+ */
+void tgp_imgstore_load (connection_data *conn, const char *filename, tgp_imgstore_loaded_cb cb, void *extra,
+                        GDestroyNotify free_extra);
+
+/**
+ * Convert a WebP image to a PNG of at most 256x256 pixels on a worker thread, like tgp_imgstore_load
+ *
+ * The PNG is stored at png_cache, and will be read from there instead if it already exists.
+ */
+void tgp_imgstore_load_webp (connection_data *conn, const char *filename, const char *png_cache,
+                             tgp_imgstore_loaded_cb cb, void *extra, GDestroyNotify free_extra);
+
+/**
+ * Add the data to the imgstore and return its id, taking ownership of data
+ *
+ * When the same bytes are already stored, the data is freed and the existing image is returned
+ * instead. Either way the caller owns one reference to the returned id. When the data cannot
+ * be stored, it is freed and 0 is returned.
+ */
+int tgp_imgstore_add_data (connection_data *conn, gpointer data, gsize len);
+
+/**
+ * Pass one reference of the imgstore image id to the image manager
+ *
+ * The manager holds at most one reference per image. Images shown in the conversation with the
+ * given peer are kept until that conversation is closed, other images are released in least
+ * recently used order, as soon as all images together exceed TGP_IMGSTORE_MAX_BYTES. Use NULL as
+ * conversation for images that are not shown in any conversation.
+ */
+void tgp_imgstore_add (connection_data *conn, int id, const tgl_peer_id_t *conversation);
+
+/**
+ * Release the images of a conversation that was closed, unless they are shown in other ones
+ */
+void tgp_imgstore_conversation_closed (connection_data *conn, tgl_peer_id_t conversation);
+
+/**
+ * The number of bytes used by all images held by the image manager
+ */
+gsize tgp_imgstore_get_resident_bytes (connection_data *conn);
+
+/**
+ * The number of bytes that did not need to be stored again, because they were already stored
+ */
+gsize tgp_imgstore_get_saved_bytes (connection_data *conn);
+
+void tgp_imgstore_free_all (connection_data *conn);
+
+#endif
@@ -0,0 +1,429 @@
+/*
+ This file is part of telegram-purple
+ 
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ 
+ Copyright Matthias Jentsch 2014-2015
+ */
+
+#include "tgp-loader.h"
+#include "tgp-structs.h"
+#include "tgp-utils.h"
+#include "telegram-purple.h"
+#include "msglog.h"
+
+#include <purple.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <string.h>
+
+enum tgp_loader_kind {
+  tgp_loader_photo,
+  tgp_loader_document,
+  tgp_loader_audio,
+  tgp_loader_video,
+  tgp_loader_encr_document
+};
+
+static const char *tgp_loader_kind_names[] = {
+  "photo",
+  "document",
+  "audio",
+  "video",
+  "encr"
+};
+struct tgp_loader_waiter {
+  tgp_loader_cb cb;
+  void *extra;
+};
+
+struct tgp_load {
+  connection_data *conn;
+  enum tgp_loader_kind kind;
+  enum tgp_loader_priority priority;
+  void *media;
+  long long id;
+  long long size;
+  char *key;
+  char *filename;
+  char *partial;
+  GList *waiters;
+  guint timer;
+  int queued;
+  int keep;
+};
+
+static void tgp_loader_schedule (connection_data *conn);
+
+void tgp_load_free (gpointer data) {
+  struct tgp_load *L = data;
+  if (L->timer) {
+    purple_timeout_remove (L->timer);
+  }
+  tgp_g_list_free_full (L->waiters, g_free);
+  g_free (L->partial);
+  g_free (L->filename);
+  g_free (L->key);
+  g_free (L);
+}
+
+static void tgp_loader_done (struct tgl_state *TLS, struct tgp_load *L, int success) {
+  
+  // callbacks may request the same media again, which must start a new load
+  g_hash_table_steal (L->conn->loads, L->key);
+  
+  GList *waiters;
+  for (waiters = L->waiters; waiters; waiters = g_list_next (waiters)) {
+    struct tgp_loader_waiter *W = waiters->data;
+    W->cb (TLS, W->extra, success, L->filename);
+  }
+  tgp_load_free (L);
+}
+
+static void tgp_loader_on_loaded (struct tgl_state *TLS, void *extra, int success, const char *filename) {
+  struct tgp_load *L = extra;
+  connection_data *conn = L->conn;
+  
+  if (success && L->keep) {
+    char *path = g_build_filename (conn->cache_dir, L->key, NULL);
+    if (! g_rename (filename, path)) {
+      L->filename = path;
+    } else {
+      warning ("cannot move %s into cache: %s", filename, g_strerror (errno));
+      g_free (path);
+      L->filename = g_strdup (filename);
+    }
+  } else if (success && L->waiters) {
+    
+    // a file loaded for a single transfer is handed over to it and not cached
+    L->filename = g_strdup (filename);
+  } else if (success) {
+    debug ("%s not needed anymore, removing it", L->key);
+    g_unlink (filename);
+  }
+  tgp_loader_done (TLS, L, success);
+  
+  -- conn->loads_running;
+  tgp_loader_schedule (conn);
+}
+
+static gboolean tgp_loader_on_cached (gpointer data) {
+  struct tgp_load *L = data;
+  L->timer = 0;
+  tgp_loader_done (L->conn->TLS, L, TRUE);
+  return FALSE;
+}
+
+static void tgp_loader_start (struct tgl_state *TLS, struct tgp_load *L) {
+  debug ("loading %s (%lld bytes)", L->key, L->size);
+  ++ L->conn->loads_running;
+  
+  switch (L->kind) {
+    case tgp_loader_photo:
+      tgl_do_load_photo (TLS, L->media, tgp_loader_on_loaded, L);
+      break;
+    case tgp_loader_document:
+      tgl_do_load_document (TLS, L->media, tgp_loader_on_loaded, L);
+      break;
+    case tgp_loader_audio:
+      tgl_do_load_audio (TLS, L->media, tgp_loader_on_loaded, L);
+      break;
+    case tgp_loader_video:
+      tgl_do_load_video (TLS, L->media, tgp_loader_on_loaded, L);
+      break;
+    case tgp_loader_encr_document:
+      tgl_do_load_encr_document (TLS, L->media, tgp_loader_on_loaded, L);
+      break;
+  }
+}
+
+static gboolean tgp_loader_schedule_cb (gpointer data) {
+  connection_data *conn = data;
+  conn->load_timer = 0;
+  tgp_loader_schedule (conn);
+  return FALSE;
+}
+
+/*
+  Token bucket for the download rate limit: the bucket fills up with the allowed number of
+  bytes per second and holds at most one second worth of bytes. Since libtgl loads a file as
+  a whole, a load may start as soon as the bucket is not empty and takes its size from it,
+  which will keep the following loads back until the debt is paid off. A single load runs at
+  full speed anyway, so it is charged at most TGP_LOADER_RATE_BURST seconds worth of bytes,
+  otherwise one large file would hold back all later loads for a long time.
+
+  Returns the number of milliseconds until the next load may start.
+ */
+static guint tgp_loader_tokens_wait (connection_data *conn) {
+  double rate = conn->settings.download_rate_limit * 1024.0;
+  if (rate <= 0) {
+    return 0;
+  }
+  
+  gint64 now = g_get_monotonic_time ();
+  if (conn->load_tokens_updated) {
+    conn->load_tokens += rate * (now - conn->load_tokens_updated) / G_USEC_PER_SEC;
+  } else {
+    conn->load_tokens = rate;
+  }
+  if (conn->load_tokens > rate) {
+    conn->load_tokens = rate;
+  }
+  conn->load_tokens_updated = now;
+  
+  if (conn->load_tokens > 0) {
+    return 0;
+  }
+  return (guint) (-conn->load_tokens / rate * 1000) + 1;
+}
+
+/*
+  Start queued loads by priority, as long as there are free slots and the rate limit permits
+ */
+static void tgp_loader_schedule (connection_data *conn) {
+  while (conn->loads_running < TGP_LOADER_MAX_RUNNING) {
+    struct tgp_load *L = NULL;
+    int i;
+    for (i = 0; i < TGP_LOADER_PRIORITY_NUM && ! L; i ++) {
+      L = g_queue_peek_head (conn->load_queues[i]);
+    }
+    if (! L) {
+      return;
+    }
+    
+    // files the user asked for are not held back by the rate limit
+    if (L->priority != TGP_LOADER_INTERACTIVE) {
+      guint wait = tgp_loader_tokens_wait (conn);
+      if (wait) {
+        if (! conn->load_timer) {
+          conn->load_timer = purple_timeout_add (wait, tgp_loader_schedule_cb, conn);
+        }
+        return;
+      }
+      if (conn->settings.download_rate_limit > 0) {
+        double burst = conn->settings.download_rate_limit * 1024.0 * TGP_LOADER_RATE_BURST;
+        conn->load_tokens -= MIN (L->size, burst);
+      }
+    }
+    
+    g_queue_pop_head (conn->load_queues[L->priority]);
+    L->queued = FALSE;
+    tgp_loader_start (conn->TLS, L);
+  }
+}
+
+static void tgp_loader_enqueue (connection_data *conn, struct tgp_load *L, enum tgp_loader_priority priority) {
+  L->priority = priority;
+  L->queued = TRUE;
+  g_queue_push_tail (conn->load_queues[priority], L);
+  tgp_loader_schedule (conn);
+}
+
+static void tgp_loader_request (struct tgl_state *TLS, enum tgp_loader_kind kind, long long id, long long size,
+                                void *media, enum tgp_loader_priority priority, tgp_loader_cb cb, void *extra) {
+  connection_data *conn = TLS->ev_base;
+  
+  struct tgp_loader_waiter *W = g_new0 (struct tgp_loader_waiter, 1);
+  W->cb = cb;
+  W->extra = extra;
+  
+  char *key = g_strdup_printf ("%s_%lld", tgp_loader_kind_names[kind], id);
+  struct tgp_load *L = g_hash_table_lookup (conn->loads, key);
+  if (L) {
+    debug ("%s already loading, waiting for it", key);
+    L->waiters = g_list_append (L->waiters, W);
+    L->keep = TRUE;
+    g_free (key);
+    
+    // a user waiting for a queued preview should not wait for the previews queued before it
+    if (L->queued && priority < L->priority) {
+      g_queue_remove (conn->load_queues[L->priority], L);
+      tgp_loader_enqueue (conn, L, priority);
+    }
+    return;
+  }
+  
+  L = g_new0 (struct tgp_load, 1);
+  L->conn = conn;
+  L->kind = kind;
+  L->media = media;
+  L->id = id;
+  L->size = size;
+  L->key = key;
+  L->keep = kind == tgp_loader_photo || priority != TGP_LOADER_INTERACTIVE;
+  L->waiters = g_list_append (L->waiters, W);
+  g_hash_table_insert (conn->loads, L->key, L);
+  
+  char *path = g_build_filename (conn->cache_dir, key, NULL);
+  if (g_file_test (path, G_FILE_TEST_IS_REGULAR)) {
+    debug ("%s found in cache", key);
+    L->filename = path;
+    L->timer = purple_timeout_add (0, tgp_loader_on_cached, L);
+    return;
+  }
+  g_free (path);
+  tgp_loader_enqueue (conn, L, priority);
+}
+
+/*
+  Find the load the given waiter is waiting for
+ */
+static struct tgp_load *tgp_loader_find (connection_data *conn, void *extra, GList **waiter) {
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init (&iter, conn->loads);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    struct tgp_load *L = value;
+    GList *waiters;
+    for (waiters = L->waiters; waiters; waiters = g_list_next (waiters)) {
+      struct tgp_loader_waiter *W = waiters->data;
+      if (W->extra == extra) {
+        *waiter = waiters;
+        return L;
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+  libtgl writes documents to download_<id> in its download directory while they are loading,
+  followed by an extension if the type is known
+ */
+static char *tgp_loader_find_partial (const char *dir, long long id) {
+  char *prefix = g_strdup_printf ("download_%lld", id);
+  size_t len = strlen (prefix);
+  char *path = NULL;
+  
+  GDir *D = g_dir_open (dir, 0, NULL);
+  if (D) {
+    const char *name;
+    while ((name = g_dir_read_name (D))) {
+      if (! strncmp (name, prefix, len) && (! name[len] || name[len] == '.')) {
+        path = g_build_filename (dir, name, NULL);
+        break;
+      }
+    }
+    g_dir_close (D);
+  }
+  g_free (prefix);
+  return path;
+}
+
+long long tgp_loader_get_loaded (connection_data *conn, void *extra) {
+  GList *waiter = NULL;
+  struct tgp_load *L = tgp_loader_find (conn, extra, &waiter);
+  if (! L || L->queued || L->timer || L->kind == tgp_loader_photo) {
+    return -1;
+  }
+  if (! L->partial) {
+    L->partial = tgp_loader_find_partial (conn->TLS->downloads_directory, L->id);
+    if (! L->partial) {
+      return -1;
+    }
+  }
+  GStatBuf st;
+  if (g_stat (L->partial, &st)) {
+    return -1;
+  }
+  return st.st_size;
+}
+
+int tgp_loader_is_cached (connection_data *conn, const char *filename) {
+  char *dir = g_path_get_dirname (filename);
+  int cached = ! strcmp (dir, conn->cache_dir);
+  g_free (dir);
+  return cached;
+}
+
+int tgp_loader_is_running (connection_data *conn, void *extra) {
+  GList *waiter = NULL;
+  struct tgp_load *L = tgp_loader_find (conn, extra, &waiter);
+  return L && ! L->queued && ! L->timer;
+}
+
+void tgp_loader_cancel (connection_data *conn, void *extra) {
+  GList *waiter = NULL;
+  struct tgp_load *L = tgp_loader_find (conn, extra, &waiter);
+  if (! L) {
+    return;
+  }
+  g_free (waiter->data);
+  L->waiters = g_list_delete_link (L->waiters, waiter);
+  if (L->waiters) {
+    return;
+  }
+  
+  // libtgl can't abort running loads, they still finish and fill the cache
+  if (L->queued) {
+    debug ("%s not needed anymore, dropping it from the queue", L->key);
+    g_queue_remove (conn->load_queues[L->priority], L);
+    g_hash_table_remove (conn->loads, L->key);
+  } else if (L->timer) {
+    g_hash_table_remove (conn->loads, L->key);
+  }
+}
+
+static long long tgp_loader_photo_size (struct tgl_photo *P) {
+  // libtgl loads the largest available size
+  long long size = 0;
+  int i;
+  for (i = 0; i < P->sizes_num; i ++) {
+    if (P->sizes[i].size > size) {
+      size = P->sizes[i].size;
+    }
+  }
+  return size;
+}
+
+void tgp_loader_load_photo (struct tgl_state *TLS, struct tgl_photo *P, enum tgp_loader_priority priority,
+                            tgp_loader_cb cb, void *extra) {
+  tgp_loader_request (TLS, tgp_loader_photo, P->id, tgp_loader_photo_size (P), P, priority, cb, extra);
+}
+
+void tgp_loader_load_document (struct tgl_state *TLS, struct tgl_document *D, enum tgp_loader_priority priority,
+                               tgp_loader_cb cb, void *extra) {
+  tgp_loader_request (TLS, tgp_loader_document, D->id, D->size, D, priority, cb, extra);
+}
+
+void tgp_loader_load_audio (struct tgl_state *TLS, struct tgl_document *D, enum tgp_loader_priority priority,
+                            tgp_loader_cb cb, void *extra) {
+  tgp_loader_request (TLS, tgp_loader_audio, D->id, D->size, D, priority, cb, extra);
+}
+
+void tgp_loader_load_video (struct tgl_state *TLS, struct tgl_document *D, enum tgp_loader_priority priority,
+                            tgp_loader_cb cb, void *extra) {
+  tgp_loader_request (TLS, tgp_loader_video, D->id, D->size, D, priority, cb, extra);
+}
+
+void tgp_loader_load_encr_document (struct tgl_state *TLS, struct tgl_encr_document *D,
+                                    enum tgp_loader_priority priority, tgp_loader_cb cb, void *extra) {
+  tgp_loader_request (TLS, tgp_loader_encr_document, D->id, D->size, D, priority, cb, extra);
+}
+
+void tgp_loader_free_all (connection_data *conn) {
+  if (conn->load_timer) {
+    purple_timeout_remove (conn->load_timer);
+    conn->load_timer = 0;
+  }
+  int i;
+  for (i = 0; i < TGP_LOADER_PRIORITY_NUM; i ++) {
+    g_queue_free (conn->load_queues[i]);
+    conn->load_queues[i] = NULL;
+  }
+  g_hash_table_destroy (conn->loads);
+  conn->loads = NULL;
+}
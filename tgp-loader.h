@@ -0,0 +1,80 @@
+/*
+ This file is part of telegram-purple
+ 
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ 
+ Copyright Matthias Jentsch 2014-2015
+ */
+
+#ifndef __telegram_adium__tgp_loader__
+#define __telegram_adium__tgp_loader__
+
+#include <tgl.h>
+
+#include "tgp-structs.h"
+
+typedef void (*tgp_loader_cb) (struct tgl_state *TLS, void *extra, int success, const char *filename);
+
+/**
+ * Load media files through the download cache
+ *
+ * Completed downloads of photos and of media requested as preview or background loads are
+ * stored in the cache directory, named by the kind and id of the media, and will be reused
+ * by all later requests. Media that is only requested interactively by a single waiter is not
+ * cached, the callback gets the file as libtgl wrote it and must move or remove it. Requests
+ * for media that is already loading will wait for the running download instead of starting
+ * a new one. The callback is always called asynchronously.
+ *
+ * Downloads are queued by priority and only TGP_LOADER_MAX_RUNNING of them run at the same
+ * time, additionally limited by the download rate set in the account options.
+ */
+void tgp_loader_load_photo (struct tgl_state *TLS, struct tgl_photo *P, enum tgp_loader_priority priority,
+                            tgp_loader_cb cb, void *extra);
+void tgp_loader_load_document (struct tgl_state *TLS, struct tgl_document *D, enum tgp_loader_priority priority,
+                               tgp_loader_cb cb, void *extra);
+void tgp_loader_load_audio (struct tgl_state *TLS, struct tgl_document *D, enum tgp_loader_priority priority,
+                            tgp_loader_cb cb, void *extra);
+void tgp_loader_load_video (struct tgl_state *TLS, struct tgl_document *D, enum tgp_loader_priority priority,
+                            tgp_loader_cb cb, void *extra);
+void tgp_loader_load_encr_document (struct tgl_state *TLS, struct tgl_encr_document *D,
+                                    enum tgp_loader_priority priority, tgp_loader_cb cb, void *extra);
+
+/**
+ * Whether the load the waiter with the given extra data waits for is being downloaded right now,
+ * as opposed to waiting in the queue or being served from the cache
+ */
+int tgp_loader_is_running (connection_data *conn, void *extra);
+
+/**
+ * Return the number of bytes libtgl has written so far for the running load the waiter with the
+ * given extra data waits for, or -1 if that is not known
+ */
+long long tgp_loader_get_loaded (connection_data *conn, void *extra);
+
+/**
+ * Whether filename is a file in the download cache, which must be kept in place
+ */
+int tgp_loader_is_cached (connection_data *conn, const char *filename);
+
+/**
+ * Stop waiting for a load, the callback of the waiter with the given extra data won't be
+ * called anymore. Queued loads that nobody waits for are dropped.
+ */
+void tgp_loader_cancel (connection_data *conn, void *extra);
+
+void tgp_load_free (gpointer data);
+void tgp_loader_free_all (connection_data *conn);
+
+#endif
@@ -36,6 +36,9 @@
 #include "tgp-2prpl.h"
 #include "tgp-chat.h"
 #include "tgp-utils.h"
+#include "tgp-loader.h"
+#include "tgp-upload.h"
+#include "tgp-imgstore.h"
 #include "tgp-chat.h"
 #include "msglog.h"
 
@@ -211,15 +214,20 @@ static gboolean tgp_msg_send_schedule_cb (gpointer data) {
     g_queue_pop_head (conn->out_messages);
 
     // TODO: option for disable_msg_preview
-    tgl_do_send_message (D->TLS, D->to, D->msg, (int)strlen (D->msg), 0, NULL, tgp_msg_send_done, NULL);
+    tgl_do_send_message (D->TLS, D->to, D->msg, D->len, 0, NULL, tgp_msg_send_done, NULL);
     tgp_msg_sending_free (D);
   }
   return FALSE;
 }
 
-static void tgp_msg_send_schedule (struct tgl_state *TLS, gchar *chunk, tgl_peer_id_t to) {
+/*
+  Chunks are slices of a shared message buffer, owned by the last chunk of the message. Since
+  the queue is always processed and freed in order, the buffer outlives all its slices.
+ */
+static void tgp_msg_send_schedule (struct tgl_state *TLS, const gchar *chunk, int len, gchar *data,
+                                   tgl_peer_id_t to) {
   connection_data *conn = TLS->ev_base;
-  struct tgp_msg_sending *D = tgp_msg_sending_init (TLS, chunk, to);
+  struct tgp_msg_sending *D = tgp_msg_sending_init (TLS, chunk, len, data, to);
   g_queue_push_tail (conn->out_messages, D);
 
   if (conn->out_timer) {
@@ -228,21 +236,34 @@ static void tgp_msg_send_schedule (struct tgl_state *TLS, gchar *chunk, tgl_peer
   conn->out_timer = purple_timeout_add (0, tgp_msg_send_schedule_cb, conn);
 }
 
-static int tgp_msg_send_split (struct tgl_state *TLS, const char *message, tgl_peer_id_t to) {
-  int max = TGP_DEFAULT_MAX_MSG_SPLIT_COUNT;
-  if (max < 1) {
-    max = 1;
+/*
+  Takes ownership of message
+ */
+static int tgp_msg_send_split (struct tgl_state *TLS, gchar *message, tgl_peer_id_t to) {
+  const char *chunks[TGP_DEFAULT_MAX_MSG_SPLIT_COUNT > 0 ? TGP_DEFAULT_MAX_MSG_SPLIT_COUNT : 1];
+  int lens[G_N_ELEMENTS(chunks)];
+  int cnt = 0, len;
+  const char *chunk;
+  
+  struct tgp_utf8_splitter S;
+  tgp_utf8_splitter_init (&S, message, TGP_MAX_MSG_SIZE);
+  while ((len = tgp_utf8_splitter_next (&S, &chunk)) > 0) {
+    if (cnt == (int) G_N_ELEMENTS(chunks)) {
+      g_free (message);
+      return -E2BIG;
+    }
+    chunks[cnt] = chunk;
+    lens[cnt] = len;
+    ++ cnt;
   }
-  int size = (int)g_utf8_strlen(message, -1);
-  if (size > TGP_MAX_MSG_SIZE * max) {
-    return -E2BIG;
+  if (! cnt) {
+    g_free (message);
+    return 1;
   }
-  int start = 0;
-  while (size > start) {
-    int e = start + (int)TGP_MAX_MSG_SIZE;
-    gchar *chunk = g_utf8_substring (message, start, e);
-    tgp_msg_send_schedule (TLS, chunk, to);
-    start = e;
+  
+  int i;
+  for (i = 0; i < cnt; i ++) {
+    tgp_msg_send_schedule (TLS, chunks[i], lens[i], i == cnt - 1 ? message : NULL, to);
   }
   return 1;
 }
@@ -289,24 +310,19 @@ int tgp_msg_send (struct tgl_state *TLS, const char *message, tgl_peer_id_t to)
       int imgid = atoi (id);
       if (imgid > 0) {
         PurpleStoredImage *psi = purple_imgstore_find_by_id (imgid);
-        gchar *tmp = g_build_filename (g_get_tmp_dir(), purple_imgstore_get_filename (psi), NULL) ;
-        GError *err = NULL;
-        gconstpointer data = purple_imgstore_get_data (psi);
-        g_file_set_contents (tmp, data, purple_imgstore_get_size (psi), &err);
-        if (! err) {
-          stripped = g_strstrip(purple_markup_strip_html (message));
-          tgl_do_send_document (TLS, to, tmp, stripped, (int)strlen (stripped),
-                                TGL_SEND_MSG_FLAG_DOCUMENT_AUTO, send_inline_picture_done, NULL);
-          g_free (stripped);
-          
-          // return 0 to assure that the picture is not echoed, since
-          // it will already be echoed with the outgoing message
-          return 0;
-        } else {
-          failure ("Storing %s in imagestore failed: %s\n", tmp, err->message);
-          g_error_free (err);
+        if (! psi) {
+          failure ("Image %d not found in imagestore", imgid);
           return -1;
         }
+        stripped = g_strstrip (tgp_markup_html_to_text (message));
+        tgp_upload_data (TLS, to, purple_imgstore_get_filename (psi), purple_imgstore_get_data (psi),
+                         purple_imgstore_get_size (psi), stripped, TGL_SEND_MSG_FLAG_DOCUMENT_AUTO,
+                         send_inline_picture_done, NULL);
+        g_free (stripped);
+        
+        // return 0 to assure that the picture is not echoed, since
+        // it will already be echoed with the outgoing message
+        return 0;
       }
     }
     // no image id found in image
@@ -319,49 +335,80 @@ int tgp_msg_send (struct tgl_state *TLS, const char *message, tgl_peer_id_t to)
     while Pidgin will replace special chars with the escape chars and also add 
     additional markup for RTL languages and such.
 
-    First, we remove any HTML markup added by Pidgin, since Telegram won't handle it properly.
-    User-entered HTML is still escaped and therefore won't be harmed.
-   */
-  stripped = purple_markup_strip_html (message);
-  
-  /* 
-    now unescape the markup, so that html special chars will still show
-    up properly in Telegram
+    Remove any HTML markup added by Pidgin and unescape the HTML special chars in the same pass,
+    since Telegram won't handle markup properly. User-entered HTML is escaped by Pidgin and will 
+    therefore show up as entered.
    */
-  gchar *unescaped = purple_unescape_text (stripped);
-  int ret = tgp_msg_send_split (TLS, stripped, to);
-  
-  g_free (unescaped);
-  g_free (stripped);
-  return ret;
+  return tgp_msg_send_split (TLS, tgp_markup_html_to_text (message), to);
 #endif
   
-  return tgp_msg_send_split (TLS, message, to);
+  return tgp_msg_send_split (TLS, g_strdup (message), to);
+}
+
+/*
+  The peer whose conversation displays this message
+ */
+static tgl_peer_id_t tgp_msg_conversation (struct tgl_state *TLS, struct tgl_message *M) {
+  if (tgl_get_peer_type (M->to_id) == TGL_PEER_USER && ! tgp_our_msg (TLS, M)) {
+    return M->from_id;
+  }
+  return M->to_id;
 }
 
-static char *tgp_msg_photo_display (struct tgl_state *TLS, const char *filename, int *flags) {
+static char *tgp_msg_photo_display (struct tgl_state *TLS, struct tgl_message *M, struct tgp_msg_loading *C,
+                                    int *flags) {
   connection_data *conn = TLS->ev_base;
-  int img = p2tgl_imgstore_add_with_id (filename);
+  if (! C->data) {
+    failure ("Cannot display picture, loading it failed.");
+    return NULL;
+  }
+  
+  // the imgstore takes ownership of the data
+  int img = tgp_imgstore_add_data (conn, C->data, C->data_len);
+  C->data = NULL;
   if (img <= 0) {
     failure ("Cannot display picture, adding to imgstore failed.");
     return NULL;
   }
-  used_images_add (conn, img);
+  tgl_peer_id_t conversation = tgp_msg_conversation (TLS, M);
+  tgp_imgstore_add (conn, img, &conversation);
   *flags |= PURPLE_MESSAGE_IMAGES;
   return tgp_format_img (img);
 }
 
-static char *tgp_msg_sticker_display (struct tgl_state *TLS, const char *filename, int *flags) {
+#ifdef HAVE_LIBWEBP
+static char *tgp_msg_sticker_key (struct tgl_message *M) {
+  if (M->media.type == tgl_message_media_document_encr) {
+    return g_strdup_printf ("sticker_encr_%lld", M->media.encr_document->id);
+  }
+  return g_strdup_printf ("sticker_%lld", M->media.document->id);
+}
+#endif
+
+static char *tgp_msg_sticker_display (struct tgl_state *TLS, struct tgl_message *M, struct tgp_msg_loading *C,
+                                      int *flags) {
   connection_data *conn = TLS->ev_base;
   char *text = NULL;
   
 #ifdef HAVE_LIBWEBP
-  int img = p2tgl_imgstore_add_with_id_webp ((char *) filename);
-  if (img <= 0) {
-    failure ("Cannot display sticker, adding to imgstore failed");
-    return NULL;
+  // stickers that are still alive in the imgstore have already been resolved while loading
+  int img = C->image;
+  C->image = 0;
+  if (! img) {
+    if (! C->data) {
+      failure ("Cannot display sticker, loading it failed");
+      return NULL;
+    }
+    img = tgp_imgstore_add_data (conn, C->data, C->data_len);
+    C->data = NULL;
+    if (img <= 0) {
+      failure ("Cannot display sticker, adding to imgstore failed");
+      return NULL;
+    }
+    g_hash_table_replace (conn->sticker_images, tgp_msg_sticker_key (M), GINT_TO_POINTER (img));
   }
-  used_images_add (conn, img);
+  tgl_peer_id_t conversation = tgp_msg_conversation (TLS, M);
+  tgp_imgstore_add (conn, img, &conversation);
   text = tgp_format_img (img);
   *flags |= PURPLE_MESSAGE_IMAGES;
 #else
@@ -404,8 +451,7 @@ static void tgp_msg_display (struct tgl_state *TLS, struct tgp_msg_loading *C) {
     switch (M->media.type) {
   
       case tgl_message_media_photo: {
-        assert (C->data);
-        text = tgp_msg_photo_display (TLS, C->data, &flags);
+        text = tgp_msg_photo_display (TLS, M, C, &flags);
         if (str_not_empty (text)) {
           if (str_not_empty (M->media.caption)) {
             char *old = text;
@@ -418,11 +464,9 @@ static void tgp_msg_display (struct tgl_state *TLS, struct tgp_msg_loading *C) {
         
       case tgl_message_media_document:
         if (M->media.document->flags & TGLDF_STICKER) {
-          assert (C->data);
-          text = tgp_msg_sticker_display (TLS, C->data, &flags);
+          text = tgp_msg_sticker_display (TLS, M, C, &flags);
         } else if (M->media.document->flags & TGLDF_IMAGE) {
-          assert (C->data);
-          text = tgp_msg_photo_display (TLS, C->data, &flags);
+          text = tgp_msg_photo_display (TLS, M, C, &flags);
         } else {
           char *who = p2tgl_strdup_id (M->from_id);
           if (! tgp_our_msg(TLS, M)) {
@@ -443,11 +487,9 @@ static void tgp_msg_display (struct tgl_state *TLS, struct tgp_msg_loading *C) {
         
       case tgl_message_media_document_encr:
         if (M->media.encr_document->flags & TGLDF_STICKER) {
-          assert (C->data);
-          text = tgp_msg_sticker_display (TLS, C->data, &flags);
-        } if (M->media.encr_document->flags & TGLDF_IMAGE) {
-          assert (C->data);
-          text = tgp_msg_photo_display (TLS, C->data, &flags);
+          text = tgp_msg_sticker_display (TLS, M, C, &flags);
+        } else if (M->media.encr_document->flags & TGLDF_IMAGE) {
+          text = tgp_msg_photo_display (TLS, M, C, &flags);
         } else {
           char *who = p2tgl_strdup_id (M->to_id);
           if (! tgp_our_msg(TLS, M)) {
@@ -481,12 +523,9 @@ static void tgp_msg_display (struct tgl_state *TLS, struct tgp_msg_loading *C) {
                                 format_geo_link_osm (M->media.venue.geo.latitude, M->media.geo.longitude));
         break;
         
-      case tgl_message_media_webpage: {
-        char *msg = g_strdup (M->message);
-        text = purple_markup_escape_text (msg, strlen (msg));
-        g_free (msg);
+      case tgl_message_media_webpage:
+        text = tgp_markup_text_to_html (M->message, (int) strlen (M->message));
         break;
-      }
         
       default:
         warning ("received unknown media type: %d", M->media.type);
@@ -495,7 +534,7 @@ static void tgp_msg_display (struct tgl_state *TLS, struct tgp_msg_loading *C) {
     
   } else {
     if (str_not_empty (M->message)) {
-      text = purple_markup_escape_text (M->message, strlen (M->message));
+      text = tgp_markup_text_to_html (M->message, (int) strlen (M->message));
     }
     flags |= PURPLE_MESSAGE_RECV;
   }
@@ -517,12 +556,12 @@ static void tgp_msg_display (struct tgl_state *TLS, struct tgp_msg_loading *C) {
       if (tgp_chat_show (TLS, &P->chat)) {
         p2tgl_got_chat_in (TLS, M->to_id, M->from_id, text, flags, M->date);
       }
-      pending_reads_add (conn->pending_reads, M->to_id);
+      pending_reads_add (conn, M->to_id);
       break;
     }
     case TGL_PEER_ENCR_CHAT: {
       p2tgl_got_im (TLS, M->to_id, text, flags, M->date);
-      pending_reads_add (conn->pending_reads, M->to_id);
+      pending_reads_add (conn, M->to_id);
       break;
     }
     case TGL_PEER_USER: {
@@ -532,14 +571,14 @@ static void tgp_msg_display (struct tgl_state *TLS, struct tgp_msg_loading *C) {
         p2tgl_got_im_combo (TLS, M->to_id, text, flags, M->date);
       } else {
         p2tgl_got_im (TLS, M->from_id, text, flags, M->date);
-        pending_reads_add (conn->pending_reads, M->from_id);
+        pending_reads_add (conn, M->from_id);
       }
       break;
     }
   }
   
-  if (p2tgl_status_is_present (purple_account_get_active_status (conn->pa)) && p2tgl_send_notifications(conn->pa)) {
-    pending_reads_send_all (conn->pending_reads, conn->TLS);
+  if (conn->settings.present && p2tgl_send_notifications (conn->pa)) {
+    pending_reads_send_delayed (conn);
   }
   
   g_free (text);
@@ -547,8 +586,7 @@ static void tgp_msg_display (struct tgl_state *TLS, struct tgp_msg_loading *C) {
 
 static time_t tgp_msg_oldest_relevant_ts (struct tgl_state *TLS) {
   connection_data *conn = TLS->ev_base;
-  int days = purple_account_get_int (conn->pa, TGP_KEY_HISTORY_RETRIEVAL_THRESHOLD,
-                                     TGP_DEFAULT_HISTORY_RETRIEVAL_THRESHOLD);
+  int days = conn->settings.history_retrieval_threshold;
   return days > 0 ? tgp_time_n_days_ago (days) : 0;
 }
 
@@ -562,19 +600,64 @@ static void tgp_msg_process_in_ready (struct tgl_state *TLS) {
     }
     g_queue_pop_head (conn->new_messages);
     tgp_msg_display (TLS, C);
-    if (C->data) {
-      g_free (C->data);
-    }
     tgp_msg_loading_free (C);
   }
 }
 
+static void tgp_msg_on_loaded_image (connection_data *conn, void *extra, gchar *data, gsize len) {
+  struct tgp_msg_loading *C = extra;
+  C->data = data;
+  C->data_len = len;
+  -- C->pending;
+  tgp_msg_process_in_ready (conn->TLS);
+}
+
+static int tgp_msg_is_sticker (struct tgl_message *M) {
+  switch (M->media.type) {
+    case tgl_message_media_document:
+    case tgl_message_media_video:
+    case tgl_message_media_audio:
+      return M->media.document->flags & TGLDF_STICKER;
+    case tgl_message_media_document_encr:
+      return M->media.encr_document->flags & TGLDF_STICKER;
+    default:
+      return FALSE;
+  }
+}
+
+/*
+  Reading and converting the loaded images is done on the worker threads, the message is
+  displayed once the image data is ready
+ */
 static void tgp_msg_on_loaded_document (struct tgl_state *TLS, void *extra, int success, const char *filename) {
   debug ("tgp_msg_on_loaded_document()");
   assert (success);
   
+  connection_data *conn = TLS->ev_base;
   struct tgp_msg_loading *C = extra;
-  C->data = (void *) g_strdup (filename);
+  
+  if (! tgp_msg_is_sticker (C->msg)) {
+    tgp_imgstore_load (conn, filename, tgp_msg_on_loaded_image, C, NULL);
+    return;
+  }
+  
+#ifdef HAVE_LIBWEBP
+  // stickers are converted only once, the imgstore id is reused as long as the image is alive
+  // and the converted PNG is kept in the download cache for later sessions
+  char *key = tgp_msg_sticker_key (C->msg);
+  int img = GPOINTER_TO_INT (g_hash_table_lookup (conn->sticker_images, key));
+  if (img > 0 && purple_imgstore_find_by_id (img)) {
+    purple_imgstore_ref_by_id (img);
+    C->image = img;
+  } else {
+    char *png = g_strdup_printf ("%s" G_DIR_SEPARATOR_S "%s.png", conn->cache_dir, key);
+    tgp_imgstore_load_webp (conn, filename, png, tgp_msg_on_loaded_image, C, NULL);
+    g_free (png);
+    g_free (key);
+    return;
+  }
+  g_free (key);
+#endif
   -- C->pending;
   tgp_msg_process_in_ready (TLS);
 }
@@ -590,6 +673,24 @@ static void tgp_msg_on_loaded_chat_full (struct tgl_state *TLS, void *extra, int
   tgp_msg_process_in_ready (TLS);
 }
 
+/*
+  The same message may be delivered multiple times, for example through both the new_msg and 
+  msg_receive callbacks or when updates are replayed after reconnecting.
+ */
+static int tgp_msg_is_duplicate (struct tgl_state *TLS, struct tgl_message *M) {
+  connection_data *conn = TLS->ev_base;
+  
+  tgl_peer_id_t peer = M->to_id;
+  if (tgl_get_peer_type (M->to_id) == TGL_PEER_USER && tgl_get_peer_id (M->to_id) == TLS->our_id) {
+    peer = M->from_id;
+  }
+  if (tgp_msg_dedup_seen (&conn->msg_dedup, peer, M->id)) {
+    debug ("Message %lld already received, ignored (%d duplicates).", M->id, conn->msg_dedup.duplicates);
+    return TRUE;
+  }
+  return FALSE;
+}
+
 void tgp_msg_recv (struct tgl_state *TLS, struct tgl_message *M) {
   connection_data *conn = TLS->ev_base;
   if (M->flags & (TGLMF_EMPTY | TGLMF_DELETED)) {
@@ -602,6 +703,9 @@ void tgp_msg_recv (struct tgl_state *TLS, struct tgl_message *M) {
     debug ("Message from %d on %d too old, ignored.", tgl_get_peer_id (M->from_id), M->date);
     return;
   }
+  if (tgp_msg_is_duplicate (TLS, M)) {
+    return;
+  }
   
   struct tgp_msg_loading *C = tgp_msg_loading_init (M);
   
@@ -612,7 +716,7 @@ void tgp_msg_recv (struct tgl_state *TLS, struct tgl_message *M) {
       switch (M->media.type) {
         case tgl_message_media_photo:
           ++ C->pending;
-          tgl_do_load_photo (TLS, M->media.photo, tgp_msg_on_loaded_document, C);
+          tgp_loader_load_photo (TLS, M->media.photo, TGP_LOADER_PREVIEW, tgp_msg_on_loaded_document, C);
           break;
           
         // documents that are stickers or images will be displayed just like regular photo messages
@@ -622,13 +726,15 @@ void tgp_msg_recv (struct tgl_state *TLS, struct tgl_message *M) {
         case tgl_message_media_audio:
           if (M->media.document->flags & TGLDF_STICKER || M->media.document->flags & TGLDF_IMAGE) {
             ++ C->pending;
-            tgl_do_load_document (TLS, M->media.document, tgp_msg_on_loaded_document, C);
+            tgp_loader_load_document (TLS, M->media.document, TGP_LOADER_PREVIEW,
+                                      tgp_msg_on_loaded_document, C);
           }
           break;
         case tgl_message_media_document_encr:
           if (M->media.encr_document->flags & TGLDF_STICKER || M->media.encr_document->flags & TGLDF_IMAGE) {
             ++ C->pending;
-            tgl_do_load_encr_document (TLS, M->media.encr_document, tgp_msg_on_loaded_document, C);
+            tgp_loader_load_encr_document (TLS, M->media.encr_document, TGP_LOADER_PREVIEW,
+                                           tgp_msg_on_loaded_document, C);
           }
           break;
           
@@ -39,6 +39,7 @@
 
 #include "tgp-net.h"
 #include "tgp-structs.h"
+#include "tgp-ft.h"
 #include "telegram-base.h"
 #include <tgl.h>
 #include <tgl-inner.h>
@@ -482,6 +483,7 @@ static void try_read (struct connection *c) {
   c->in_bytes += x;
   if (x) {
     try_rpc_read (c);
+    tgprpl_xfer_update_progress (c->TLS->ev_base);
   }
 }
 
@@ -24,49 +24,73 @@
 #include "msglog.h"
 #include "tgp-utils.h"
 #include "tgp-ft.h"
+#include "tgp-2prpl.h"
+#include "tgp-loader.h"
+#include "tgp-upload.h"
+#include "tgp-imgstore.h"
+#include "tgp-worker.h"
 
 #include <glib.h>
 #include <tgl.h>
 
-static void pending_reads_free_cb (gpointer data) {
-  free (data);
-}
-
-static gint pending_reads_compare (gconstpointer a, gconstpointer b) {
-  return !memcmp ((tgl_peer_id_t *)a, (tgl_peer_id_t *)b, sizeof(tgl_peer_id_t));
-}
-
-void pending_reads_send_all (GQueue *queue, struct tgl_state *TLS) {
+void pending_reads_send_all (connection_data *conn) {
   debug ("send all pending ack");
   
-  tgl_peer_id_t *pending;
+  if (conn->pending_reads_timer) {
+    purple_timeout_remove (conn->pending_reads_timer);
+    conn->pending_reads_timer = 0;
+  }
   
-  while ((pending = (tgl_peer_id_t*) g_queue_pop_head(queue))) {
-    tgl_do_mark_read (TLS, *pending, tgp_notify_on_error_gw, NULL);
-    debug ("tgl_do_mark_read (%d)", pending->id);
-    free (pending);
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init (&iter, conn->pending_reads);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    struct tgp_pending_read *R = value;
+    tgl_do_mark_read (conn->TLS, R->id, tgp_notify_on_error_gw, NULL);
+    debug ("tgl_do_mark_read (%d)", tgl_get_peer_id (R->id));
+    g_hash_table_iter_remove (&iter);
   }
 }
 
-void pending_reads_add (GQueue *queue, tgl_peer_id_t id) {
-  tgl_peer_id_t *copy = malloc (sizeof(tgl_peer_id_t));
-  *copy = id;
-  if (! g_queue_find_custom (queue, copy, pending_reads_compare)) {
-    g_queue_push_tail (queue, copy);
+static gboolean pending_reads_send_cb (gpointer data) {
+  connection_data *conn = data;
+  conn->pending_reads_timer = 0;
+  
+  // the user may have turned read notifications off while they were delayed
+  if (p2tgl_send_notifications (conn->pa)) {
+    pending_reads_send_all (conn);
   }
+  return FALSE;
 }
 
-static void used_image_free (gpointer data) {
-  int id = GPOINTER_TO_INT(data);
-  purple_imgstore_unref_by_id (id);
+void pending_reads_send_delayed (connection_data *conn) {
+  
+  // the timer is not restarted by new messages, so that busy chats are still acknowledged once
+  // every TGP_PENDING_READS_DELAY seconds
+  if (! conn->pending_reads_timer && g_hash_table_size (conn->pending_reads)) {
+    conn->pending_reads_timer = purple_timeout_add_seconds (TGP_PENDING_READS_DELAY, pending_reads_send_cb, conn);
+  }
 }
 
-void used_images_add (connection_data *data, gint imgid) {
-  data->used_images = g_list_append (data->used_images, GINT_TO_POINTER(imgid));
+void pending_reads_add (connection_data *conn, tgl_peer_id_t id) {
+  
+  // tgl_do_mark_read always marks the whole history of the peer as read, so one entry per peer
+  // is all that needs to be remembered
+  if (! g_hash_table_lookup (conn->pending_reads, &id)) {
+    struct tgp_pending_read *R = g_new0 (struct tgp_pending_read, 1);
+    R->id = id;
+    g_hash_table_insert (conn->pending_reads, &R->id, R);
+  }
 }
 
 void tgp_msg_loading_free (gpointer data) {
   struct tgp_msg_loading *C = data;
+  if (C->data) {
+    g_free (C->data);
+  }
+  if (C->image) {
+    purple_imgstore_unref_by_id (C->image);
+  }
   free (C);
 }
 
@@ -75,20 +99,27 @@ struct tgp_msg_loading *tgp_msg_loading_init (struct tgl_message *M) {
   C->pending = 0;
   C->msg = M;
   C->data = NULL;
+  C->data_len = 0;
+  C->image = 0;
   return C;
 }
 
-struct tgp_msg_sending *tgp_msg_sending_init (struct tgl_state *TLS, gchar *M, tgl_peer_id_t to) {
+struct tgp_msg_sending *tgp_msg_sending_init (struct tgl_state *TLS, const gchar *M, int len, gchar *data,
+                                               tgl_peer_id_t to) {
   struct tgp_msg_sending *C = malloc (sizeof (struct tgp_msg_sending));
   C->TLS = TLS;
   C->msg = M;
+  C->len = len;
+  C->data = data;
   C->to = to;
   return C;
 }
 
 void tgp_msg_sending_free (gpointer data) {
   struct tgp_msg_sending *C = data;
-  g_free (C->msg);
+  if (C->data) {
+    g_free (C->data);
+  }
   free (C);
 }
 
@@ -99,23 +130,51 @@ connection_data *connection_data_init (struct tgl_state *TLS, PurpleConnection *
   conn->pa = pa;
   conn->new_messages = g_queue_new ();
   conn->out_messages = g_queue_new ();
-  conn->pending_reads = g_queue_new ();
+  conn->pending_reads = g_hash_table_new_full (tgp_peer_id_hash, tgp_peer_id_equal, NULL, g_free);
   conn->pending_chat_info = g_hash_table_new (g_direct_hash, g_direct_equal);
+  tgp_msg_dedup_init (&conn->msg_dedup);
+  conn->sticker_images = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  conn->loads = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, tgp_load_free);
+  int i;
+  for (i = 0; i < TGP_LOADER_PRIORITY_NUM; i ++) {
+    conn->load_queues[i] = g_queue_new ();
+  }
+  connection_data_update_settings (conn, purple_account_get_active_status (pa));
   return conn;
 }
 
+void connection_data_update_settings (connection_data *conn, PurpleStatus *status) {
+  struct tgp_settings *S = &conn->settings;
+  S->present = p2tgl_status_is_present (status);
+  S->display_read_notifications = purple_account_get_bool (conn->pa, TGP_KEY_DISPLAY_READ_NOTIFICATIONS,
+                                                           TGP_DEFAULT_DISPLAY_READ_NOTIFICATIONS);
+  S->inactive_days_offline = purple_account_get_int (conn->pa, TGP_KEY_INACTIVE_DAYS_OFFLINE,
+                                                     TGP_DEFAULT_INACTIVE_DAYS_OFFLINE);
+  S->history_retrieval_threshold = purple_account_get_int (conn->pa, TGP_KEY_HISTORY_RETRIEVAL_THRESHOLD,
+                                                           TGP_DEFAULT_HISTORY_RETRIEVAL_THRESHOLD);
+  S->download_rate_limit = purple_account_get_int (conn->pa, TGP_KEY_DOWNLOAD_RATE_LIMIT,
+                                                   TGP_DEFAULT_DOWNLOAD_RATE_LIMIT);
+}
+
 void *connection_data_free (connection_data *conn) {
   if (conn->write_timer) { purple_timeout_remove (conn->write_timer); }
   if (conn->login_timer) { purple_timeout_remove (conn->login_timer); }
   if (conn->out_timer) { purple_timeout_remove (conn->out_timer); }
+  if (conn->pending_reads_timer) { purple_timeout_remove (conn->pending_reads_timer); }
   
-  tgp_g_queue_free_full (conn->pending_reads, pending_reads_free_cb);
+  g_hash_table_destroy (conn->pending_reads);
   tgp_g_queue_free_full (conn->new_messages, tgp_msg_loading_free);
   tgp_g_queue_free_full (conn->out_messages, tgp_msg_sending_free);
-  tgp_g_list_free_full (conn->used_images, used_image_free);
+  tgp_imgstore_free_all (conn);
+  g_hash_table_destroy (conn->sticker_images);
   g_hash_table_destroy (conn->pending_chat_info);
+  tgp_msg_dedup_free (&conn->msg_dedup);
   tgprpl_xfer_free_all (conn);
+  tgp_worker_free_all (conn);
   tgl_free_all (conn->TLS);
+  tgp_loader_free_all (conn);
+  tgp_upload_free_all (conn);
+  g_free (conn->cache_dir);
   g_free(conn->TLS->base_path);
   free (conn->TLS);
   
@@ -26,23 +26,89 @@
 #include <tgl.h>
 #include <glib.h>
 
+#define TGP_RECENT_MSG_IDS 512
+
+/*
+  Priority classes of media loads, lower values are started first
+ */
+enum tgp_loader_priority {
+  TGP_LOADER_INTERACTIVE,
+  TGP_LOADER_PREVIEW,
+  TGP_LOADER_BACKGROUND,
+  TGP_LOADER_PRIORITY_NUM
+};
+
+/*
+  Snapshot of the account settings read on hot paths, to avoid hash lookups for every
+  message or status update. It is only refreshed on login and status changes, so settings
+  that must take effect right away, like sending read notifications, are not part of it.
+ */
+struct tgp_settings {
+  int present;
+  int display_read_notifications;
+  int inactive_days_offline;
+  int history_retrieval_threshold;
+  int download_rate_limit;
+};
+
+struct tgp_recent_msg {
+  tgl_peer_id_t peer;
+  long long id;
+};
+
+/*
+  Recently received messages, to recognize the same message when it is delivered again
+ */
+struct tgp_msg_dedup {
+  GHashTable *high_water;
+  struct tgp_recent_msg recent[TGP_RECENT_MSG_IDS];
+  int recent_pos;
+  int duplicates;
+};
+
 typedef struct {
   struct tgl_state *TLS;
   char *hash;
   PurpleAccount *pa;
   PurpleConnection *gc;
+  struct tgp_settings settings;
   int updated;
   GQueue *new_messages;
   GQueue *out_messages;
-  GQueue *pending_reads;
-  GList *used_images;
+  GHashTable *pending_reads;
+  GHashTable *images;
+  GQueue *images_unused;
+  GHashTable *conversation_images;
+  gsize images_bytes;
+  GHashTable *image_hashes;
+  gsize images_bytes_saved;
+  GThreadPool *worker_pool;
+  GAsyncQueue *worker_results;
+  GList *worker_jobs;
+  int worker_pipe[2];
+  guint worker_input;
+  GHashTable *sticker_images;
+  GList *xfers;
+  long long xfer_downloaded_bytes;
+  long long xfer_uploaded_bytes;
+  GHashTable *loads;
+  GQueue *load_queues[TGP_LOADER_PRIORITY_NUM];
+  int loads_running;
+  double load_tokens;
+  gint64 load_tokens_updated;
+  guint load_timer;
+  GList *uploads;
+  GKeyFile *upload_index;
+  char *cache_dir;
   guint write_timer;
   guint login_timer;
   guint out_timer;
+  guint pending_reads_timer;
   int in_fallback_chat;
   int password_retries;
   PurpleRoomlist *roomlist;
   GHashTable *pending_chat_info;
+  struct tgp_msg_dedup msg_dedup;
 } connection_data;
 
 typedef struct { 
@@ -51,8 +117,17 @@ typedef struct {
 } get_user_info_data;
 
 struct tgp_xfer_send_data {
-  int timer;
+  int loading;
+  double bytes;
   int done;
+  int canceled;
+  int retries;
+  guint retry_timer;
+  guint copy_timer;
+  FILE *copy_in;
+  FILE *copy_out;
+  char *copy_from;
+  struct tgp_upload *upload;
   PurpleXfer *xfer;
   connection_data *conn;
   struct tgl_message *msg;
@@ -67,12 +142,25 @@ struct tgp_msg_loading {
   int pending;
   struct tgl_message *msg;
   void *data;
+  gsize data_len;
+  int image;
+};
+
+struct tgp_pending_read {
+  tgl_peer_id_t id;
+};
+
+struct tgp_msg_high_water {
+  tgl_peer_id_t id;
+  long long max_msg_id;
 };
 
 struct tgp_msg_sending {
   struct tgl_state *TLS;
   tgl_peer_id_t to;
-  gchar *msg;
+  const gchar *msg;
+  int len;
+  gchar *data;
 };
 
 struct accept_secret_chat_data {
@@ -85,16 +173,17 @@ struct accept_create_chat_data {
   char *title;
 };
 
-void pending_reads_send_all (GQueue *queue, struct tgl_state *TLS);
-void pending_reads_add (GQueue *queue, tgl_peer_id_t id);
+void pending_reads_send_all (connection_data *conn);
+void pending_reads_send_delayed (connection_data *conn);
+void pending_reads_add (connection_data *conn, tgl_peer_id_t id);
 struct message_text *message_text_init (struct tgl_message *M, gchar *text);
 void message_text_free (gpointer data);
-void used_images_add (connection_data *data, gint imgid);
 void *connection_data_free (connection_data *conn);
 connection_data *connection_data_init (struct tgl_state *TLS, PurpleConnection *gc, PurpleAccount *pa);
+void connection_data_update_settings (connection_data *conn, PurpleStatus *status);
 get_user_info_data* get_user_info_data_new (int show_info, tgl_peer_id_t peer);
 struct tgp_msg_loading *tgp_msg_loading_init (struct tgl_message *M);
-struct tgp_msg_sending *tgp_msg_sending_init (struct tgl_state *TLS, char *M, tgl_peer_id_t to);
+struct tgp_msg_sending *tgp_msg_sending_init (struct tgl_state *TLS, const char *M, int len, char *data, tgl_peer_id_t to);
 void tgp_msg_loading_free (gpointer data);
 void tgp_msg_sending_free (gpointer data);
 #endif
@@ -0,0 +1,400 @@
+/*
+ This file is part of telegram-purple
+ 
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ 
+ Copyright Matthias Jentsch 2014-2015
+ */
+
+#include "tgp-upload.h"
+#include "tgp-structs.h"
+#include "tgp-utils.h"
+#include "tgp-worker.h"
+#include "msglog.h"
+
+#include <purple.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#define TGP_UPLOAD_HASH_CHUNK 65536
+#define TGP_UPLOAD_INDEX_GROUP "uploads"
+#define TGP_UPLOAD_INDEX_MAX 2048
+
+struct tgp_upload_hash_job {
+  struct tgp_upload *upload;
+  char *path;
+  char *hash;
+  int err;
+};
+
+struct tgp_upload {
+  connection_data *conn;
+  tgl_peer_id_t to;
+  char *path;
+  char *tmp_dir;
+  char *name;
+  gpointer data;
+  gsize len;
+  char *caption;
+  int flags;
+  tgp_upload_cb cb;
+  void *extra;
+  struct tgp_upload_hash_job *hashing;
+  char *hash;
+  guint timer;
+  int sending;
+  int calling;
+  guint result_timer;
+  int result_success;
+  struct tgl_message *result;
+};
+
+static void tgp_upload_free (struct tgp_upload *U) {
+  if (U->timer) {
+    purple_timeout_remove (U->timer);
+  }
+  if (U->result_timer) {
+    purple_timeout_remove (U->result_timer);
+  }
+  if (U->hashing) {
+    // the worker still runs, its result is dropped
+    U->hashing->upload = NULL;
+  }
+  U->conn->uploads = g_list_remove (U->conn->uploads, U);
+  if (U->tmp_dir) {
+    g_unlink (U->path);
+    g_rmdir (U->tmp_dir);
+    g_free (U->tmp_dir);
+  }
+  g_free (U->hash);
+  g_free (U->data);
+  g_free (U->name);
+  g_free (U->caption);
+  g_free (U->path);
+  g_free (U);
+}
+
+static char *tgp_upload_index_path (connection_data *conn) {
+  return g_build_filename (conn->TLS->base_path, "uploads", NULL);
+}
+
+/*
+  The index maps the content hash of sent files to the id of the message that carries the
+  uploaded media. It is loaded lazily and written back whenever it changes. Entries are kept
+  in the order they were last used and only the TGP_UPLOAD_INDEX_MAX most recent ones are kept.
+ */
+static GKeyFile *tgp_upload_index (connection_data *conn) {
+  if (! conn->upload_index) {
+    conn->upload_index = g_key_file_new ();
+    char *path = tgp_upload_index_path (conn);
+    g_key_file_load_from_file (conn->upload_index, path, G_KEY_FILE_NONE, NULL);
+    g_free (path);
+  }
+  return conn->upload_index;
+}
+
+static void tgp_upload_index_save (connection_data *conn) {
+  gsize len = 0;
+  char *data = g_key_file_to_data (conn->upload_index, &len, NULL);
+  char *path = tgp_upload_index_path (conn);
+  GError *err = NULL;
+  if (! g_file_set_contents (path, data, len, &err)) {
+    warning ("cannot write upload index %s: %s", path, err->message);
+    g_error_free (err);
+  }
+  g_free (path);
+  g_free (data);
+}
+
+static void tgp_upload_index_store (connection_data *conn, const char *hash, long long msg_id) {
+  GKeyFile *index = tgp_upload_index (conn);
+  
+  // re-adding moves the entry to the end, so the least recently used entries are dropped first
+  g_key_file_remove_key (index, TGP_UPLOAD_INDEX_GROUP, hash, NULL);
+  g_key_file_set_int64 (index, TGP_UPLOAD_INDEX_GROUP, hash, msg_id);
+  
+  gsize len = 0;
+  char **keys = g_key_file_get_keys (index, TGP_UPLOAD_INDEX_GROUP, &len, NULL);
+  gsize i;
+  for (i = 0; keys && len - i > TGP_UPLOAD_INDEX_MAX; i ++) {
+    g_key_file_remove_key (index, TGP_UPLOAD_INDEX_GROUP, keys[i], NULL);
+  }
+  g_strfreev (keys);
+  tgp_upload_index_save (conn);
+}
+
+static gboolean tgp_upload_on_result (gpointer data) {
+  struct tgp_upload *U = data;
+  U->result_timer = 0;
+  U->cb (U->conn->TLS, U->extra, U->result_success, U->result);
+  tgp_upload_free (U);
+  return FALSE;
+}
+
+/*
+  libtgl calls back before tgl_do_send_document or tgl_do_forward_media returned when they fail
+  right away. The caller may not have stored the handle yet, so those results are delivered from
+  the event loop.
+ */
+static void tgp_upload_done (struct tgl_state *TLS, struct tgp_upload *U, int success, struct tgl_message *M) {
+  U->sending = 0;
+  if (success && M && U->hash) {
+    tgp_upload_index_store (U->conn, U->hash, M->id);
+  }
+  if (U->calling) {
+    U->result_success = success;
+    U->result = M;
+    U->result_timer = purple_timeout_add (0, tgp_upload_on_result, U);
+    return;
+  }
+  U->cb (TLS, U->extra, success, M);
+  tgp_upload_free (U);
+}
+
+static void tgp_upload_on_sent (struct tgl_state *TLS, void *extra, int success, struct tgl_message *M) {
+  tgp_upload_done (TLS, extra, success, M);
+}
+
+static void tgp_upload_send (struct tgp_upload *U) {
+  U->sending = 1;
+  ++ U->calling;
+  tgl_do_send_document (U->conn->TLS, U->to, U->path, U->caption, U->caption ? (int) strlen (U->caption) : 0,
+                        U->flags, tgp_upload_on_sent, U);
+  -- U->calling;
+}
+
+/*
+  libtgl only uploads from a path and derives the file name and type from it, so data from memory
+  is written to a private temporary directory, that is removed as soon as libtgl is done with it
+ */
+static int tgp_upload_write_tmp (struct tgp_upload *U, gconstpointer data, gsize len) {
+  GError *err = NULL;
+  U->tmp_dir = g_dir_make_tmp ("telegram-purple-XXXXXX", &err);
+  if (U->tmp_dir) {
+    char *basename = str_not_empty (U->name) ? g_path_get_basename (U->name)
+        : g_strdup_printf ("image.%s", purple_util_get_image_extension (data, len));
+    U->path = g_build_filename (U->tmp_dir, basename, NULL);
+    g_free (basename);
+    g_file_set_contents (U->path, data, len, &err);
+  }
+  if (err) {
+    failure ("cannot store upload in temporary directory: %s", err->message);
+    g_error_free (err);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void tgp_upload_on_forwarded (struct tgl_state *TLS, void *extra, int success, struct tgl_message *M) {
+  struct tgp_upload *U = extra;
+  if (! success) {
+    // the message with the original media is gone, fall back to a full upload
+    debug ("forwarding media of %s failed, uploading it", U->hash);
+    g_key_file_remove_key (tgp_upload_index (U->conn), TGP_UPLOAD_INDEX_GROUP, U->hash, NULL);
+    if (U->data && ! tgp_upload_write_tmp (U, U->data, U->len)) {
+      tgp_upload_done (TLS, U, FALSE, NULL);
+      return;
+    }
+    tgp_upload_send (U);
+    return;
+  }
+  tgp_upload_done (TLS, U, success, M);
+}
+
+static void tgp_upload_hashed (struct tgp_upload *U) {
+  GKeyFile *index = tgp_upload_index (U->conn);
+  
+  if (g_key_file_has_key (index, TGP_UPLOAD_INDEX_GROUP, U->hash, NULL)) {
+    long long msg_id = g_key_file_get_int64 (index, TGP_UPLOAD_INDEX_GROUP, U->hash, NULL);
+    debug ("%s already uploaded in message %lld, forwarding media", U->hash, msg_id);
+    ++ U->calling;
+    tgl_do_forward_media (U->conn->TLS, U->to, msg_id, 0, tgp_upload_on_forwarded, U);
+    -- U->calling;
+    return;
+  }
+  tgp_upload_send (U);
+}
+
+static void tgp_upload_hash_job_free (gpointer data) {
+  struct tgp_upload_hash_job *J = data;
+  if (J->upload) {
+    // dropped without a result when the account is closed
+    J->upload->hashing = NULL;
+  }
+  g_free (J->hash);
+  g_free (J->path);
+  g_free (J);
+}
+
+/*
+  Runs on a worker thread. The file is read through a fixed buffer rather than mapped, since a file
+  that is truncated while it is mapped would crash the client with SIGBUS.
+ */
+static void tgp_upload_hash_work (gpointer data) {
+  struct tgp_upload_hash_job *J = data;
+  guchar buf[TGP_UPLOAD_HASH_CHUNK];
+  size_t n;
+  
+  FILE *f = g_fopen (J->path, "rb");
+  if (! f) {
+    J->err = errno;
+    return;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  // let the kernel read ahead, this also leaves the file in the page cache for libtgl
+  posix_fadvise (fileno (f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  while ((n = fread (buf, 1, sizeof (buf), f)) > 0) {
+    g_checksum_update (checksum, buf, n);
+  }
+  if (ferror (f)) {
+    J->err = errno ? errno : EIO;
+  } else {
+    J->hash = g_strdup (g_checksum_get_string (checksum));
+  }
+  g_checksum_free (checksum);
+  fclose (f);
+}
+
+static void tgp_upload_hash_done (gpointer data) {
+  struct tgp_upload_hash_job *J = data;
+  struct tgp_upload *U = J->upload;
+  if (! U) {
+    return;
+  }
+  U->hashing = NULL;
+  J->upload = NULL;
+  
+  if (! J->hash) {
+    warning ("cannot read %s, uploading without deduplication: %s", U->path, g_strerror (J->err));
+    tgp_upload_send (U);
+    return;
+  }
+  U->hash = J->hash;
+  J->hash = NULL;
+  tgp_upload_hashed (U);
+}
+
+static struct tgp_upload *tgp_upload_new (struct tgl_state *TLS, tgl_peer_id_t to, const char *caption,
+                                          int flags, tgp_upload_cb cb, void *extra) {
+  connection_data *conn = TLS->ev_base;
+  
+  struct tgp_upload *U = g_new0 (struct tgp_upload, 1);
+  U->conn = conn;
+  U->to = to;
+  U->caption = str_not_empty (caption) ? g_strdup (caption) : NULL;
+  U->flags = flags;
+  U->cb = cb;
+  U->extra = extra;
+  conn->uploads = g_list_prepend (conn->uploads, U);
+  return U;
+}
+
+static int tgp_upload_can_forward (struct tgp_upload *U) {
+  // forwarded media cannot carry a caption and cannot be sent into secret chats
+  return ! U->caption && tgl_get_peer_type (U->to) != TGL_PEER_ENCR_CHAT;
+}
+
+struct tgp_upload *tgp_upload_document (struct tgl_state *TLS, tgl_peer_id_t to, const char *path,
+                                        const char *caption, int flags, tgp_upload_cb cb, void *extra) {
+  struct tgp_upload *U = tgp_upload_new (TLS, to, caption, flags, cb, extra);
+  U->path = g_strdup (path);
+  
+  if (! tgp_upload_can_forward (U)) {
+    tgp_upload_send (U);
+    return U;
+  }
+  
+  struct tgp_upload_hash_job *J = g_new0 (struct tgp_upload_hash_job, 1);
+  J->upload = U;
+  J->path = g_strdup (path);
+  U->hashing = J;
+  tgp_worker_run (U->conn, tgp_upload_hash_work, tgp_upload_hash_done, tgp_upload_hash_job_free, J);
+  return U;
+}
+
+static gboolean tgp_upload_on_failed (gpointer data) {
+  struct tgp_upload *U = data;
+  U->timer = 0;
+  U->cb (U->conn->TLS, U->extra, FALSE, NULL);
+  tgp_upload_free (U);
+  return FALSE;
+}
+
+struct tgp_upload *tgp_upload_data (struct tgl_state *TLS, tgl_peer_id_t to, const char *name,
+                                    gconstpointer data, gsize len, const char *caption, int flags,
+                                    tgp_upload_cb cb, void *extra) {
+  struct tgp_upload *U = tgp_upload_new (TLS, to, caption, flags, cb, extra);
+  U->name = g_strdup (name);
+  
+  // data that is already known to the server never touches the disk
+  if (tgp_upload_can_forward (U)) {
+    U->hash = g_compute_checksum_for_data (G_CHECKSUM_SHA256, data, len);
+    if (g_key_file_has_key (tgp_upload_index (U->conn), TGP_UPLOAD_INDEX_GROUP, U->hash, NULL)) {
+      // keep the data for a full upload if forwarding fails
+      U->data = g_memdup (data, len);
+      U->len = len;
+      tgp_upload_hashed (U);
+      return U;
+    }
+  }
+  
+  if (! tgp_upload_write_tmp (U, data, len)) {
+    // results are always delivered asynchronously
+    U->timer = purple_timeout_add (0, tgp_upload_on_failed, U);
+    return U;
+  }
+  tgp_upload_send (U);
+  return U;
+}
+
+int tgp_upload_cancel (struct tgp_upload *U) {
+  if (! U->timer && ! U->hashing) {
+    // already passed to libtgl
+    return FALSE;
+  }
+  U->cb (U->conn->TLS, U->extra, FALSE, NULL);
+  tgp_upload_free (U);
+  return TRUE;
+}
+
+int tgp_upload_is_sending (struct tgp_upload *U) {
+  return U->sending;
+}
+
+int tgp_upload_count_sending (connection_data *conn) {
+  int num = 0;
+  GList *uploads;
+  for (uploads = conn->uploads; uploads; uploads = g_list_next (uploads)) {
+    struct tgp_upload *U = uploads->data;
+    num += U->sending;
+  }
+  return num;
+}
+
+void tgp_upload_free_all (connection_data *conn) {
+  while (conn->uploads) {
+    tgp_upload_free (conn->uploads->data);
+  }
+  if (conn->upload_index) {
+    g_key_file_free (conn->upload_index);
+    conn->upload_index = NULL;
+  }
+}
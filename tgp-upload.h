@@ -0,0 +1,71 @@
+/*
+ This file is part of telegram-purple
+ 
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ 
+ Copyright Matthias Jentsch 2014-2015
+ */
+
+#ifndef __telegram_adium__tgp_upload__
+#define __telegram_adium__tgp_upload__
+
+#include <tgl.h>
+
+#include "tgp-structs.h"
+
+typedef void (*tgp_upload_cb) (struct tgl_state *TLS, void *extra, int success, struct tgl_message *M);
+
+struct tgp_upload;
+
+/**
+ * Send a file as document, reusing the media of an earlier message with the same content
+ *
+ * The content hash of the file is computed on a worker thread. When a file with the same hash
+ * has already been sent from this account, its media is forwarded instead of uploading the file
+ * again. The callback is never called before this function returned, and
+ * the returned handle is valid until the callback is called.
+ */
+struct tgp_upload *tgp_upload_document (struct tgl_state *TLS, tgl_peer_id_t to, const char *path,
+                                        const char *caption, int flags, tgp_upload_cb cb, void *extra);
+
+/**
+ * Send data from memory as document named name, reusing earlier uploads like tgp_upload_document
+ *
+ * The data is only used during this call and does not need to stay valid afterwards.
+ */
+struct tgp_upload *tgp_upload_data (struct tgl_state *TLS, tgl_peer_id_t to, const char *name,
+                                    gconstpointer data, gsize len, const char *caption, int flags,
+                                    tgp_upload_cb cb, void *extra);
+
+/**
+ * Abort an upload that has not been passed to libtgl yet, the callback is called with success = 0
+ *
+ * Returns whether the upload was aborted.
+ */
+int tgp_upload_cancel (struct tgp_upload *U);
+
+/**
+ * Return whether libtgl is currently sending the file, as opposed to it still being hashed
+ */
+int tgp_upload_is_sending (struct tgp_upload *U);
+
+/**
+ * Return the number of uploads that libtgl is currently sending
+ */
+int tgp_upload_count_sending (connection_data *conn);
+
+void tgp_upload_free_all (connection_data *conn);
+
+#endif
@@ -27,6 +27,14 @@
 #include "lodepng/lodepng.h"
 
 #include <purple.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 connection_data *get_conn_from_buddy (PurpleBuddy *buddy) {
   connection_data *c = purple_connection_get_protocol_data (
@@ -157,3 +165,354 @@ int tgp_startswith (const char *str, const char *with) {
   return TRUE;
 }
 
+
+guint tgp_peer_id_hash (gconstpointer key) {
+  const tgl_peer_id_t *id = key;
+  return (guint) tgl_get_peer_id (*id) * 31 + (guint) tgl_get_peer_type (*id);
+}
+
+gboolean tgp_peer_id_equal (gconstpointer a, gconstpointer b) {
+  const tgl_peer_id_t *A = a, *B = b;
+  return tgl_get_peer_id (*A) == tgl_get_peer_id (*B) && tgl_get_peer_type (*A) == tgl_get_peer_type (*B);
+}
+
+int tgp_file_clone (const char *from, const char *to) {
+#ifdef FICLONE
+  int in = g_open (from, O_RDONLY, 0);
+  if (in < 0) {
+    return FALSE;
+  }
+  int out = g_open (to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    int err = errno;
+    close (in);
+    errno = err;
+    return FALSE;
+  }
+  int ok = ! ioctl (out, FICLONE, in);
+  int err = errno;
+  close (in);
+  close (out);
+  if (! ok) {
+    g_unlink (to);
+  }
+  errno = err;
+  return ok;
+#else
+  errno = ENOTSUP;
+  return FALSE;
+#endif
+}
+
+void tgp_msg_dedup_init (struct tgp_msg_dedup *D) {
+  memset (D, 0, sizeof (*D));
+  D->high_water = g_hash_table_new_full (tgp_peer_id_hash, tgp_peer_id_equal, NULL, g_free);
+}
+
+void tgp_msg_dedup_free (struct tgp_msg_dedup *D) {
+  g_hash_table_destroy (D->high_water);
+  D->high_water = NULL;
+}
+
+int tgp_msg_dedup_seen (struct tgp_msg_dedup *D, tgl_peer_id_t peer, long long id) {
+  struct tgp_msg_high_water *H = g_hash_table_lookup (D->high_water, &peer);
+  if (! H) {
+    H = g_new0 (struct tgp_msg_high_water, 1);
+    H->id = peer;
+    H->max_msg_id = id;
+    g_hash_table_insert (D->high_water, &H->id, H);
+  } else if (id > H->max_msg_id) {
+    H->max_msg_id = id;
+  } else {
+    int i;
+    for (i = 0; i < TGP_RECENT_MSG_IDS; i ++) {
+      if (D->recent[i].id == id && tgp_peer_id_equal (&D->recent[i].peer, &peer)) {
+        ++ D->duplicates;
+        return TRUE;
+      }
+    }
+  }
+  
+  D->recent[D->recent_pos].peer = peer;
+  D->recent[D->recent_pos].id = id;
+  D->recent_pos = (D->recent_pos + 1) % TGP_RECENT_MSG_IDS;
+  return FALSE;
+}
+
+static int tgp_utf8_joins_previous (gunichar c) {
+  // combining marks, zero width joiners, variation selectors and skin tone modifiers
+  // belong to the preceding character and must never start a new chunk
+  return g_unichar_ismark (c) || c == 0x200D || (c >= 0xFE00 && c <= 0xFE0F)
+      || (c >= 0xE0100 && c <= 0xE01EF) || (c >= 0x1F3FB && c <= 0x1F3FF);
+}
+
+void tgp_utf8_splitter_init (struct tgp_utf8_splitter *S, const char *text, int max_chars) {
+  memset (S, 0, sizeof (*S));
+  S->start = S->scan = text;
+  S->max = max_chars > 0 ? max_chars : 1;
+}
+
+int tgp_utf8_splitter_next (struct tgp_utf8_splitter *S, const char **chunk) {
+  *chunk = S->start;
+  if (! *S->start) {
+    return 0;
+  }
+  
+  while (*S->scan) {
+    gunichar c = g_utf8_get_char (S->scan);
+    
+    // the position in front of S->scan is a possible cut, unless it tears apart a cluster
+    if (S->scan != S->start && ! tgp_utf8_joins_previous (c) && S->prev != 0x200D) {
+      S->cuts[TGP_UTF8_CUT_GRAPHEME].pos = S->scan;
+      S->cuts[TGP_UTF8_CUT_GRAPHEME].index = S->index;
+      int type = -1;
+      if (S->prev == '\n') {
+        type = S->prev_prev == '\n' ? TGP_UTF8_CUT_PARAGRAPH : TGP_UTF8_CUT_LINE;
+      } else if (g_unichar_isspace (S->prev)) {
+        type = TGP_UTF8_CUT_WORD;
+      }
+      if (type >= 0) {
+        S->cuts[type].pos = S->scan;
+        S->cuts[type].index = S->index;
+      }
+    }
+    
+    if (S->index - S->start_index == S->max) {
+      break;
+    }
+    S->prev_prev = S->prev;
+    S->prev = c;
+    S->scan = g_utf8_next_char (S->scan);
+    S->index ++;
+  }
+  
+  const char *cut = S->scan;
+  long cut_index = S->index;
+  if (*S->scan) {
+    
+    // prefer the most natural boundary, as long as it doesn't result in a tiny chunk
+    int type;
+    for (type = 0; type < TGP_UTF8_CUT_NUM; type ++) {
+      struct tgp_utf8_cut *C = &S->cuts[type];
+      if (C->pos > S->start && (C->index - S->start_index >= S->max / 2 || type == TGP_UTF8_CUT_GRAPHEME)) {
+        cut = C->pos;
+        cut_index = C->index;
+        break;
+      }
+    }
+    // when no boundary was found, a single cluster exceeds the limit and must be cut through
+  }
+  
+  int len = (int)(cut - S->start);
+  S->start = cut;
+  S->start_index = cut_index;
+  return len;
+}
+
+static int tgp_markup_tag_is (const char *name, int len, const char *tag) {
+  return (int) strlen (tag) == len && ! g_ascii_strncasecmp (name, tag, len);
+}
+
+/*
+  Return the '>' that ends the tag starting at p, skipping over quoted attribute values, which
+  may contain a '>' themselves
+ */
+static const char *tgp_markup_tag_close (const char *p) {
+  char quote = '\0';
+  char prev = '\0';
+  for (++ p; *p; ++ p) {
+    if (quote) {
+      if (*p == quote) {
+        quote = '\0';
+      }
+    } else if (*p == '>') {
+      return p;
+    } else if ((*p == '"' || *p == '\'') && prev == '=') {
+      quote = *p;
+    }
+    if (! g_ascii_isspace (*p)) {
+      prev = *p;
+    }
+  }
+  return NULL;
+}
+
+/*
+  Find the value of the attribute name between attr and the end of the tag
+ */
+static const char *tgp_markup_tag_attr (const char *attr, const char *end, const char *name, int *len) {
+  int name_len = (int) strlen (name);
+  while (attr < end) {
+    while (attr < end && g_ascii_isspace (*attr)) {
+      ++ attr;
+    }
+    const char *key = attr;
+    while (attr < end && *attr != '=' && ! g_ascii_isspace (*attr)) {
+      ++ attr;
+    }
+    int key_len = (int)(attr - key);
+    while (attr < end && g_ascii_isspace (*attr)) {
+      ++ attr;
+    }
+    if (attr >= end || *attr != '=') {
+      continue;
+    }
+    ++ attr;
+    while (attr < end && g_ascii_isspace (*attr)) {
+      ++ attr;
+    }
+    char quote = (*attr == '"' || *attr == '\'') ? *attr ++ : '\0';
+    const char *value = attr;
+    while (attr < end && (quote ? *attr != quote : ! g_ascii_isspace (*attr))) {
+      ++ attr;
+    }
+    if (key_len == name_len && ! g_ascii_strncasecmp (key, name, name_len)) {
+      *len = (int)(attr - value);
+      return value;
+    }
+    if (quote && attr < end) {
+      ++ attr;
+    }
+  }
+  return NULL;
+}
+
+/*
+  Decode all entities between in and end into out and return the new end of out
+ */
+static char *tgp_markup_unescape (char *out, const char *in, const char *end) {
+  while (in < end) {
+    int len = 0;
+    const char *ent = *in == '&' ? purple_markup_unescape_entity (in, &len) : NULL;
+    if (ent && in + len <= end) {
+      size_t ent_len = strlen (ent);
+      memcpy (out, ent, ent_len);
+      out += ent_len;
+      in += len;
+    } else {
+      *out ++ = *in ++;
+    }
+  }
+  return out;
+}
+
+static const char *tgp_markup_find_tag_end (const char *p, const char *tag) {
+  int len = (int) strlen (tag);
+  while ((p = strchr (p, '<'))) {
+    if (p[1] == '/' && ! g_ascii_strncasecmp (p + 2, tag, len)) {
+      return strchr (p, '>');
+    }
+    ++ p;
+  }
+  return NULL;
+}
+
+char *tgp_markup_html_to_text (const char *html) {
+  
+  // neither decoding entities nor replacing tags can make the text grow, so the input length
+  // is an upper bound for the output
+  char *text = g_malloc (strlen (html) + 1);
+  char *out = text;
+  
+  const char *href = NULL, *link = NULL;
+  int href_len = 0;
+  
+  const char *p = html;
+  while (*p) {
+    if (*p == '&') {
+      int len = 0;
+      const char *ent = purple_markup_unescape_entity (p, &len);
+      if (ent) {
+        size_t ent_len = strlen (ent);
+        memcpy (out, ent, ent_len);
+        out += ent_len;
+        p += len;
+        continue;
+      }
+      *out ++ = *p ++;
+      continue;
+    }
+    
+    const char *end;
+    if (*p != '<' || ! (end = tgp_markup_tag_close (p))) {
+      *out ++ = *p ++;
+      continue;
+    }
+    
+    const char *name = p + 1;
+    int closing = *name == '/';
+    if (closing) {
+      ++ name;
+    }
+    int len = 0;
+    while (g_ascii_isalnum (name[len])) {
+      ++ len;
+    }
+    
+    if (tgp_markup_tag_is (name, len, "br") || tgp_markup_tag_is (name, len, "hr")) {
+      *out ++ = '\n';
+    } else if (closing && (tgp_markup_tag_is (name, len, "p") || tgp_markup_tag_is (name, len, "div")
+                           || tgp_markup_tag_is (name, len, "tr") || tgp_markup_tag_is (name, len, "table"))) {
+      if (out > text && out[-1] != '\n') {
+        *out ++ = '\n';
+      }
+    } else if (! closing && tgp_markup_tag_is (name, len, "td")) {
+      if (out > text && out[-1] != '\t') {
+        *out ++ = '\t';
+      }
+    } else if (! closing && (tgp_markup_tag_is (name, len, "script") || tgp_markup_tag_is (name, len, "style"))) {
+      char tag[8];
+      g_strlcpy (tag, name, len + 1);
+      const char *close = tgp_markup_find_tag_end (end, tag);
+      end = close ? close : end + strlen (end) - 1;
+    } else if (tgp_markup_tag_is (name, len, "a")) {
+      if (! closing) {
+        href = tgp_markup_tag_attr (name + len, end, "href", &href_len);
+        link = out;
+      } else if (href && link) {
+        
+        // decode the target right behind the link text, where it is appended when it differs
+        // from the visible text; the <a> tag it came from left more than enough room
+        char *target = out + 2;
+        int target_len = (int)(tgp_markup_unescape (target, href, href + href_len) - target);
+        if (target_len > 7 && ! g_ascii_strncasecmp (target, "mailto:", 7)) {
+          target_len -= 7;
+          memmove (target, target + 7, target_len);
+        }
+        if (out - link != target_len || strncmp (link, target, target_len)) {
+          memcpy (out, " (", 2);
+          out[target_len + 2] = ')';
+          out += target_len + 3;
+        }
+        href = link = NULL;
+      }
+    }
+    p = end + 1;
+  }
+  *out = '\0';
+  return text;
+}
+
+char *tgp_markup_text_to_html (const char *text, int len) {
+  GString *html = g_string_sized_new (len + len / 8 + 1);
+  const char *end = text + len;
+  const char *run = text;
+  const char *p;
+  
+  for (p = text; p < end; p ++) {
+    const char *ent;
+    switch (*p) {
+      case '&': ent = "&amp;"; break;
+      case '<': ent = "&lt;"; break;
+      case '>': ent = "&gt;"; break;
+      case '"': ent = "&quot;"; break;
+      case '\'': ent = "&apos;"; break;
+      default: continue;
+    }
+    g_string_append_len (html, run, p - run);
+    g_string_append (html, ent);
+    run = p + 1;
+  }
+  g_string_append_len (html, run, end - run);
+  return g_string_free (html, FALSE);
+}
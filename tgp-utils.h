@@ -51,5 +51,77 @@ void tgp_g_queue_free_full (GQueue *queue, GDestroyNotify free_func);
 void tgp_g_list_free_full (GList *list, GDestroyNotify free_func);
 const char *tgp_mime_to_filetype (const char *mime);
 int tgp_startswith (const char *str, const char *with);
+guint tgp_peer_id_hash (gconstpointer key);
+gboolean tgp_peer_id_equal (gconstpointer a, gconstpointer b);
+
+/**
+ * Copy the file at from to to by sharing its blocks copy-on-write, replacing any existing file
+ *
+ * Only works on file systems with reflink support, like Btrfs or XFS. Returns FALSE and sets
+ * errno otherwise, so the file can be copied the usual way.
+ */
+int tgp_file_clone (const char *from, const char *to);
+
+void tgp_msg_dedup_init (struct tgp_msg_dedup *D);
+void tgp_msg_dedup_free (struct tgp_msg_dedup *D);
+
+/**
+ * Remember a received message and return whether it was already received before
+ *
+ * Message ids are only unique per peer, so messages are identified by both. Ids above the
+ * highest id seen from that peer are always new and need no lookup, lower ids are compared
+ * against a ring of the last TGP_RECENT_MSG_IDS messages.
+ */
+int tgp_msg_dedup_seen (struct tgp_msg_dedup *D, tgl_peer_id_t peer, long long id);
+
+enum {
+  TGP_UTF8_CUT_PARAGRAPH,
+  TGP_UTF8_CUT_LINE,
+  TGP_UTF8_CUT_WORD,
+  TGP_UTF8_CUT_GRAPHEME,
+  TGP_UTF8_CUT_NUM
+};
+
+struct tgp_utf8_cut {
+  const char *pos;
+  long index;
+};
+
+struct tgp_utf8_splitter {
+  const char *start;
+  const char *scan;
+  long start_index;
+  long index;
+  int max;
+  gunichar prev;
+  gunichar prev_prev;
+  struct tgp_utf8_cut cuts[TGP_UTF8_CUT_NUM];
+};
+
+/**
+ * Split an UTF-8 string into chunks of at most max_chars characters
+ *
+ * Walks the text only once and prefers to cut at paragraph, line and word boundaries, without
+ * ever tearing apart combined characters. The chunks are slices of the original text.
+ */
+void tgp_utf8_splitter_init (struct tgp_utf8_splitter *S, const char *text, int max_chars);
+
+/**
+ * Store the start of the next chunk in chunk and return its length in bytes, 0 when done
+ */
+int tgp_utf8_splitter_next (struct tgp_utf8_splitter *S, const char **chunk);
+
+/**
+ * Convert Pidgin HTML markup to Telegram plain text in a single pass
+ *
+ * Removes all markup, decodes all entities and keeps line breaks and link targets. Needs
+ * exactly one allocation, since the text is never longer than the markup.
+ */
+char *tgp_markup_html_to_text (const char *html);
+
+/**
+ * Escape Telegram plain text for displaying it as HTML markup in a single pass
+ */
+char *tgp_markup_text_to_html (const char *text, int len);
 
 #endif
@@ -0,0 +1,135 @@
+/*
+ This file is part of telegram-purple
+ 
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ 
+ Copyright Matthias Jentsch 2014-2015
+ */
+
+#include "tgp-worker.h"
+#include "tgp-utils.h"
+#include "msglog.h"
+
+#include <purple.h>
+#include <glib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+struct tgp_worker_job {
+  tgp_worker_func work;
+  tgp_worker_func done;
+  GDestroyNotify free_data;
+  gpointer data;
+  connection_data *conn;
+};
+
+static void tgp_worker_job_free (struct tgp_worker_job *J) {
+  if (J->free_data) {
+    J->free_data (J->data);
+  }
+  g_free (J);
+}
+
+/*
+  Runs on the worker threads, finished jobs are passed back through a queue and a pipe is used
+  to wake up the event loop, since libpurple event loops of other UIs (like Adium) are not
+  necessarily GLib main loops
+ */
+static void tgp_worker_thread (gpointer data, gpointer user_data) {
+  struct tgp_worker_job *J = data;
+  connection_data *conn = user_data;
+  
+  J->work (J->data);
+  g_async_queue_push (conn->worker_results, J);
+  
+  char c = 0;
+  while (write (conn->worker_pipe[1], &c, 1) < 0 && errno == EINTR) {}
+}
+
+static void tgp_worker_on_results (gpointer data, gint fd, PurpleInputCondition cond) {
+  connection_data *conn = data;
+  char buf[64];
+  while (read (fd, buf, sizeof (buf)) > 0) {}
+  
+  struct tgp_worker_job *J;
+  while ((J = g_async_queue_try_pop (conn->worker_results))) {
+    conn->worker_jobs = g_list_remove (conn->worker_jobs, J);
+    J->done (J->data);
+    tgp_worker_job_free (J);
+  }
+}
+
+static int tgp_worker_init (connection_data *conn) {
+  if (conn->worker_pool) {
+    return TRUE;
+  }
+  if (pipe (conn->worker_pipe) < 0) {
+    failure ("cannot create worker pipe: %s", g_strerror (errno));
+    return FALSE;
+  }
+  fcntl (conn->worker_pipe[0], F_SETFL, O_NONBLOCK);
+  
+  GError *err = NULL;
+  conn->worker_pool = g_thread_pool_new (tgp_worker_thread, conn, g_get_num_processors (), FALSE, &err);
+  if (! conn->worker_pool) {
+    failure ("cannot create worker threads: %s", err->message);
+    g_error_free (err);
+    close (conn->worker_pipe[0]);
+    close (conn->worker_pipe[1]);
+    return FALSE;
+  }
+  conn->worker_results = g_async_queue_new ();
+  conn->worker_input = purple_input_add (conn->worker_pipe[0], PURPLE_INPUT_READ, tgp_worker_on_results, conn);
+  return TRUE;
+}
+
+void tgp_worker_run (connection_data *conn, tgp_worker_func work, tgp_worker_func done,
+                     GDestroyNotify free_data, gpointer data) {
+  struct tgp_worker_job *J = g_new0 (struct tgp_worker_job, 1);
+  J->work = work;
+  J->done = done;
+  J->free_data = free_data;
+  J->data = data;
+  J->conn = conn;
+  
+  if (! tgp_worker_init (conn)) {
+    // without threads the job still has to be done
+    work (data);
+    done (data);
+    tgp_worker_job_free (J);
+    return;
+  }
+  conn->worker_jobs = g_list_prepend (conn->worker_jobs, J);
+  g_thread_pool_push (conn->worker_pool, J, NULL);
+}
+
+void tgp_worker_free_all (connection_data *conn) {
+  if (! conn->worker_pool) {
+    return;
+  }
+  
+  // drop queued jobs and wait for running ones, the results are never delivered
+  g_thread_pool_free (conn->worker_pool, TRUE, TRUE);
+  conn->worker_pool = NULL;
+  purple_input_remove (conn->worker_input);
+  close (conn->worker_pipe[0]);
+  close (conn->worker_pipe[1]);
+  
+  tgp_g_list_free_full (conn->worker_jobs, (GDestroyNotify) tgp_worker_job_free);
+  conn->worker_jobs = NULL;
+  g_async_queue_unref (conn->worker_results);
+  conn->worker_results = NULL;
+}
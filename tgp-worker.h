@@ -0,0 +1,41 @@
+/*
+ This file is part of telegram-purple
+ 
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ 
+ Copyright Matthias Jentsch 2014-2015
+ */
+
+#ifndef __telegram_adium__tgp_worker__
+#define __telegram_adium__tgp_worker__
+
+#include "tgp-structs.h"
+
+typedef void (*tgp_worker_func) (gpointer data);
+
+/**
+ * Run work (data) on one of the worker threads of this account and done (data) on the event loop
+ * afterwards, followed by free_data (data) if given
+ *
+ * The work function must not call into libpurple or libtgl, since neither of them is thread safe.
+ * The number of worker threads follows the number of processors. When the account is closed,
+ * pending jobs are only freed and done is not called anymore.
+ */
+void tgp_worker_run (connection_data *conn, tgp_worker_func work, tgp_worker_func done,
+                     GDestroyNotify free_data, gpointer data);
+
+void tgp_worker_free_all (connection_data *conn);
+
+#endif